@@ -0,0 +1,98 @@
+#ifndef KMONAD_HID_REPORT_HPP
+#define KMONAD_HID_REPORT_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/*
+ * Keeps track of which usages are pressed on each HID usage page, so
+ * that a sink can post 1 report per page for a whole batch of key
+ * changes instead of 1 report per change.
+ *
+ * Changes are recorded with `change` and posted with `flush`, which
+ * calls `post(page, usages)` once for every page that changed since the
+ * last flush. If a usage changes twice within 1 batch (like a tap in a
+ * macro), the first change is flushed before recording the second, so
+ * no press or release is ever lost.
+ *
+ * There is no limit on how many usages are down at once: a sink whose
+ * reports have room for fewer (like the 6 of a boot keyboard) has to
+ * truncate. `pressed` keeps the order of the presses for that.
+ *
+ * This knows nothing about the OS, so it can back any report-based
+ * sink. Not thread-safe: use it from the thread that emits keys.
+ */
+class hid_report_builder {
+public:
+    struct page_state {
+        uint32_t page;
+        bool dirty;
+        std::vector<uint32_t> pressed; // Usages currently down, oldest first
+        std::vector<uint32_t> touched; // Usages changed in this batch
+    };
+
+    /*
+     * Record a press (down = true) or release of a usage. Returns the
+     * result of the early flush if one was needed, and 0 otherwise.
+     */
+    template<typename Post>
+    int change(uint32_t page, uint32_t usage, bool down, Post post) {
+        int ret = 0;
+        page_state *p = find(page);
+        if(contains(p->touched, usage)) {
+            ret = flush(post);
+        }
+        auto it = std::find(p->pressed.begin(), p->pressed.end(), usage);
+        if(down && it == p->pressed.end()) {
+            p->pressed.push_back(usage);
+        } else if(!down && it != p->pressed.end()) {
+            p->pressed.erase(it);
+        } else {
+            return ret; // Nothing changes, so nothing to report
+        }
+        p->touched.push_back(usage);
+        p->dirty = true;
+        return ret;
+    }
+
+    /*
+     * Post 1 report for every page that changed since the last flush.
+     * Returns the first non-zero result of `post`, or 0.
+     */
+    template<typename Post>
+    int flush(Post post) {
+        int ret = 0;
+        for(page_state &p : pages) {
+            if(!p.dirty) continue;
+            int r = post(p.page, p.pressed);
+            if(r && !ret) ret = r;
+            p.dirty = false;
+            p.touched.clear();
+        }
+        return ret;
+    }
+
+    bool pending() const {
+        return std::any_of(pages.begin(), pages.end(),
+                           [](const page_state &p) { return p.dirty; });
+    }
+
+private:
+    static bool contains(const std::vector<uint32_t> &v, uint32_t x) {
+        return std::find(v.begin(), v.end(), x) != v.end();
+    }
+
+    // There are only a handful of pages, so a linear search is fastest
+    page_state *find(uint32_t page) {
+        for(page_state &p : pages) {
+            if(p.page == page) return &p;
+        }
+        pages.push_back(page_state{page, false, {}, {}});
+        return &pages.back();
+    }
+
+    std::vector<page_state> pages;
+};
+
+#endif
@@ -1,19 +1,83 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <signal.h>
 #include <string.h>
 #include <unistd.h>
 #include <linux/input.h>
 #include <linux/uinput.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <errno.h>
 #include <fcntl.h>
 
+// Static tracepoints for bpftrace and perf. When sys/sdt.h is available each
+// probe compiles to a single nop that only becomes active while something is
+// tracing it, otherwise the probes compile to nothing at all.
+//
+// Every probe has a semaphore that the tracer increments while it is attached.
+// The Haskell side reads the one of read_event directly, so that it can skip
+// the call to probe_read_event when nobody is tracing.
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define KMONAD_HAVE_SDT
+#endif
+#endif
+
+// Older headers only have the struct timeval layout of input_event
+#ifndef input_event_sec
+#define input_event_sec  time.tv_sec
+#define input_event_usec time.tv_usec
+#endif
+
+#ifdef KMONAD_HAVE_SDT
+#define KMONAD_SEMAPHORE(name) unsigned short kmonad_##name##_semaphore \
+  __attribute__((unused)) __attribute__((section(".probes")))
+#else
+#define KMONAD_SEMAPHORE(name) unsigned short kmonad_##name##_semaphore
+#define DTRACE_PROBE2(provider, name, a, b) \
+  do { (void)(a); (void)(b); } while (0)
+#define DTRACE_PROBE4(provider, name, a, b, c, d) \
+  do { (void)(a); (void)(b); (void)(c); (void)(d); } while (0)
+#define DTRACE_PROBE5(provider, name, a, b, c, d, e) \
+  do { (void)(a); (void)(b); (void)(c); (void)(d); (void)(e); } while (0)
+#endif
+
+KMONAD_SEMAPHORE(grab);
+KMONAD_SEMAPHORE(release);
+KMONAD_SEMAPHORE(read_event);
+KMONAD_SEMAPHORE(send_event);
+
 // Perform an IOCTL grab or release on an open keyboard handle
 int ioctl_keyboard(int fd, int grab) {
-  return ioctl(fd, EVIOCGRAB, grab);
+  int ret = ioctl(fd, EVIOCGRAB, grab);
+  if (grab) {
+    DTRACE_PROBE2(kmonad, grab, fd, ret);
+  } else {
+    DTRACE_PROBE2(kmonad, release, fd, ret);
+  }
+  return ret;
+}
+
+// Mark the arrival of an event read from a keyboard device. This only exists to
+// hold the probe, since the actual read happens on the Haskell side, which only
+// calls it while kmonad_read_event_semaphore is non-zero.
+void probe_read_event(int type, int code, int val, int s, int us) {
+  DTRACE_PROBE5(kmonad, read_event, type, code, val, s, us);
 }
 
-// Acquire a filedescriptor as a uinput keyboard
-int acquire_uinput_keysink(int fd, char *name, int vendor, int product, int version) {
+int send_event(int fd, int type, int code, int val, int s, int us);
+
+// Acquire a filedescriptor as a uinput keyboard. If `rep_delay` is positive the
+// kernel autorepeats held keys, starting after `rep_delay` ms and then every
+// `rep_period` ms. If `pointer` is non-zero the device can also move the pointer
+// and scroll.
+int acquire_uinput_keysink(int fd, char *name, int vendor, int product, int version,
+                           int rep_delay, int rep_period, int pointer) {
 
   // Designate fd as a keyboard of all keys
   ioctl(fd, UI_SET_EVBIT, EV_KEY);
@@ -22,6 +86,26 @@ int acquire_uinput_keysink(int fd, char *name, int vendor, int product, int vers
     ioctl(fd, UI_SET_KEYBIT, i);
   }
 
+  // Designate fd as a pointer that can move and scroll, for mouse-keys. The
+  // mouse buttons are needed for udev to recognize it as a mouse at all. Only
+  // done when asked for, since a device that looks like a mouse changes how
+  // the desktop treats other pointers (like disabling the touchpad).
+  if (pointer) {
+    ioctl(fd, UI_SET_EVBIT, EV_REL);
+    ioctl(fd, UI_SET_RELBIT, REL_X);
+    ioctl(fd, UI_SET_RELBIT, REL_Y);
+    ioctl(fd, UI_SET_RELBIT, REL_WHEEL);
+    ioctl(fd, UI_SET_RELBIT, REL_HWHEEL);
+    ioctl(fd, UI_SET_KEYBIT, BTN_LEFT);
+    ioctl(fd, UI_SET_KEYBIT, BTN_RIGHT);
+    ioctl(fd, UI_SET_KEYBIT, BTN_MIDDLE);
+  }
+
+  // Let the input core generate repeats, instead of doing it ourselves
+  if (rep_delay > 0) {
+    ioctl(fd, UI_SET_EVBIT, EV_REP);
+  }
+
   // Set the vendor details
   struct uinput_setup usetup;
   memset(&usetup, 0, sizeof(usetup));
@@ -36,6 +120,13 @@ int acquire_uinput_keysink(int fd, char *name, int vendor, int product, int vers
   // Create the device
   ioctl(fd, UI_DEV_CREATE);
 
+  // The input core starts out with its own defaults, which we overwrite by
+  // writing repeat events to the device
+  if (rep_delay > 0) {
+    send_event(fd, EV_REP, REP_DELAY,  rep_delay,  0, 0);
+    send_event(fd, EV_REP, REP_PERIOD, rep_period, 0, 0);
+  }
+
   return 0;
 }
 
@@ -50,9 +141,88 @@ int send_event(int fd, int type, int code, int val, int s, int us) {
   ie.type = type;
   ie.code = code;
   ie.value = val;
-  ie.time.tv_sec = s;
-  ie.time.tv_usec = us;
-  return write(fd, &ie, sizeof(ie));
+  ie.input_event_sec  = s;
+  ie.input_event_usec = us;
+  int ret = write(fd, &ie, sizeof(ie));
+  DTRACE_PROBE4(kmonad, send_event, type, code, val, ret);
+  return ret;
+}
+
+// Write `n` events, each given as 5 ints (type, code, value, seconds and
+// microseconds), through a non-blocking file-descriptor with as few write calls
+// as possible, starting at byte `*off` of the batch. Returns 0 once everything
+// is written, or 1 if the descriptor is not ready, with `*off` moved past what
+// was written so the caller can wait for it to become writable and continue.
+// Returns -1 on error. This never blocks, so it is safe on any runtime.
+int send_events(int fd, const int *evs, int n, int *off) {
+  struct input_event *ies = calloc(n, sizeof(struct input_event));
+  if (ies == NULL) return -1;
+  int i;
+  for (i=0; i < n; i++) {
+    ies[i].type  = evs[5*i];
+    ies[i].code  = evs[5*i + 1];
+    ies[i].value = evs[5*i + 2];
+    ies[i].input_event_sec  = evs[5*i + 3];
+    ies[i].input_event_usec = evs[5*i + 4];
+  }
+
+  size_t len = n * sizeof(struct input_event);
+  while ((size_t) *off < len) {
+    ssize_t ret = write(fd, (char *) ies + *off, len - *off);
+    if (ret > 0) {
+      *off += ret;
+    } else if (ret < 0 && errno == EINTR) {
+      continue;
+    } else {
+      free(ies);
+      return (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) ? 1 : -1;
+    }
+  }
+
+  for (i=0; i < n; i++) {
+    DTRACE_PROBE4(kmonad, send_event, ies[i].type, ies[i].code, ies[i].value,
+                  (int) sizeof(struct input_event));
+  }
+  free(ies);
+  return 0;
+}
+
+// Create a non-blocking timerfd on the monotonic clock, used to pace pointer
+// motion. Returns -1 on error.
+int motion_timer_open() {
+  return timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+}
+
+// Make a timerfd expire every `period_ns` nanoseconds (less than 1 second),
+// starting 1 period from now. A period of 0 disarms the timer.
+int motion_timer_set(int tfd, long period_ns) {
+  struct itimerspec its;
+  its.it_interval.tv_sec  = 0;
+  its.it_interval.tv_nsec = period_ns;
+  its.it_value            = its.it_interval;
+  return timerfd_settime(tfd, 0, &its, NULL);
+}
+
+// Return how often a timerfd expired since the last call, 0 if it has not
+// expired yet, or -1 on error.
+long long motion_timer_read(int tfd) {
+  uint64_t n;
+  if (read(tfd, &n, sizeof(n)) == sizeof(n)) return n;
+  return errno == EAGAIN ? 0 : -1;
+}
+
+// Report the memory layout of input_event: its total size, and the size of its
+// seconds field. Returns 1 if the time is stored as 2 __kernel_ulong_t fields
+// (32-bit userspace with a 64-bit time_t), and 0 if it is a struct timeval.
+int input_event_layout(int *size, int *sec_size) {
+  struct input_event event;
+  *size     = sizeof(event);
+  *sec_size = sizeof(event.input_event_sec);
+#if defined(__BITS_PER_LONG) && __BITS_PER_LONG == 32 && defined(__USE_TIME_BITS64)
+  return 1;
+#else
+  return 0;
+#endif
 }
 
 // Print information about memory layout of input_event
@@ -60,12 +230,10 @@ void input_event_info() {
   struct input_event event;
   printf("sizeof  event is:               %d\n", (int) sizeof(event));
   printf("alignof event is:               %d\n", (int) __alignof__(event));
-  printf("sizeof  event.time is:          %d\n", (int) sizeof(event.time));
-  printf("alignof event.time is:          %d\n", (int) __alignof__(event.time));
-  printf("sizeof  event.time.tv_sec is:   %d\n", (int) sizeof(event.time.tv_sec));
-  printf("alignof event.time.tv_sec is:   %d\n", (int) __alignof__(event.time.tv_sec));
-  printf("sizeof  event.time.tv_usec is:  %d\n", (int) sizeof(event.time.tv_usec));
-  printf("alignof event.time.tv_usec is:  %d\n", (int) __alignof__(event.time.tv_usec));
+  printf("sizeof  event sec is:           %d\n", (int) sizeof(event.input_event_sec));
+  printf("alignof event sec is:           %d\n", (int) __alignof__(event.input_event_sec));
+  printf("sizeof  event usec is:          %d\n", (int) sizeof(event.input_event_usec));
+  printf("alignof event usec is:          %d\n", (int) __alignof__(event.input_event_usec));
   printf("sizeof  event.type is:          %d\n", (int) sizeof(event.type));
   printf("alignof event.type is:          %d\n", (int) __alignof__(event.type));
   printf("sizeof  event.code is:          %d\n", (int) sizeof(event.code));
@@ -74,3 +242,53 @@ void input_event_info() {
   printf("alignof event.value is:         %d\n", (int) __alignof__(event.value));
 }
 
+// Open 1 hardware counter for the calling thread, as part of group `lead`, or
+// as a new (disabled) group-leader if `lead` is -1. We only count user-space,
+// which works without root as long as perf_event_paranoid <= 2.
+static int open_counter(unsigned long long config, int lead) {
+  struct perf_event_attr pe;
+  memset(&pe, 0, sizeof(pe));
+  pe.type = PERF_TYPE_HARDWARE;
+  pe.size = sizeof(pe);
+  pe.config = config;
+  pe.disabled = (lead == -1);
+  pe.exclude_kernel = 1;
+  pe.exclude_hv = 1;
+  pe.read_format = PERF_FORMAT_GROUP;
+  return syscall(__NR_perf_event_open, &pe, 0, -1, lead, 0);
+}
+
+// Close the 3 counters opened by perf_counters_open
+void perf_counters_close(int *fds) {
+  int i;
+  for (i=0; i < 3; i++) {
+    if (fds[i] != -1) close(fds[i]);
+  }
+}
+
+// Open and start a group of cycle, instruction and cache-miss counters for the
+// calling thread, writing their 3 descriptors to `fds`.
+int perf_counters_open(int *fds) {
+  fds[0] = open_counter(PERF_COUNT_HW_CPU_CYCLES, -1);
+  if (fds[0] == -1) return -1;
+  fds[1] = open_counter(PERF_COUNT_HW_INSTRUCTIONS, fds[0]);
+  fds[2] = open_counter(PERF_COUNT_HW_CACHE_MISSES, fds[0]);
+  if (fds[1] == -1 || fds[2] == -1) {
+    perf_counters_close(fds);
+    return -1;
+  }
+  ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  return 0;
+}
+
+// Read the current values of a counter group into `vals` (cycles, instructions,
+// cache-misses), using a single read on the group-leader.
+int perf_counters_read(int lead, uint64_t *vals) {
+  uint64_t buf[4];
+  if (read(lead, buf, sizeof(buf)) != sizeof(buf)) return -1;
+  vals[0] = buf[1];
+  vals[1] = buf[2];
+  vals[2] = buf[3];
+  return 0;
+}
@@ -8,6 +8,8 @@
 #include <mach/mach_error.h>
 
 #include "karabiner_virtual_hid_device_methods.hpp"
+#include "../spsc_ring.hpp"
+#include "../hid_report.hpp"
 
 /*
  * Key event information that's shared between C++ and Haskell.
@@ -33,6 +35,7 @@ static pqrs::karabiner_virtual_hid_device::hid_report::keyboard_input keyboard;
 static pqrs::karabiner_virtual_hid_device::hid_report::apple_vendor_top_case_input top_case;
 static pqrs::karabiner_virtual_hid_device::hid_report::apple_vendor_keyboard_input apple_keyboard;
 static pqrs::karabiner_virtual_hid_device::hid_report::consumer_input consumer;
+static hid_report_builder reports;
 
 /*
  * These are needed to receive unaltered key events from the OS.
@@ -40,7 +43,7 @@ static pqrs::karabiner_virtual_hid_device::hid_report::consumer_input consumer;
 static std::thread thread;
 static CFRunLoopRef listener_loop;
 static std::map<io_service_t,IOHIDDeviceRef> source_device;
-static int fd[2];
+static spsc_ring<struct KeyEvent, 1024> events;
 static char *prod = nullptr;
 
 void print_iokit_error(const char *fname, int freturn = 0) {
@@ -57,8 +60,8 @@ void print_iokit_error(const char *fname, int freturn = 0) {
  * We'll register this callback to run whenever an IOHIDDevice
  * (representing a keyboard) sends input from the user.
  *
- * It passes the relevant information into a pipe that will be read
- * from with wait_key.
+ * It passes the relevant information into a ring buffer that will be
+ * read from with wait_key.
  */
 void input_callback(void *context, IOReturn result, void *sender, IOHIDValueRef value) {
     struct KeyEvent e;
@@ -66,7 +69,7 @@ void input_callback(void *context, IOReturn result, void *sender, IOHIDValueRef
     e.type = IOHIDValueGetIntegerValue(value);
     e.page = IOHIDElementGetUsagePage(element);
     e.usage = IOHIDElementGetUsage(element);
-    write(fd[1], &e, sizeof(struct KeyEvent));
+    events.push(e);
 }
 
 void open_matching_devices(char *product, io_iterator_t iter) {
@@ -137,41 +140,59 @@ void terminated_callback(void *context, io_iterator_t iter) {
 }
 
 /*
- * This gets us some code reuse (see the send_key overload below)
+ * This gets us some code reuse (see post_report below)
  */
 template<typename T>
-int send_key(T &keyboard, struct KeyEvent *e) {
-    if(e->type == 1) keyboard.keys.insert(e->usage);
-    else if(e->type == 0) keyboard.keys.erase(e->usage);
-    else return 1;
+int post_report(T &keyboard, const std::vector<uint32_t> &usages) {
+    keyboard.keys.clear();
+    for(uint32_t usage : usages) keyboard.keys.insert(usage);
     return pqrs::karabiner_virtual_hid_device_methods::post_keyboard_input_report(connect, keyboard);
 }
 
 /*
- * Haskell calls this with a new key event to send back to the OS. It
- * posts the information to the karabiner kernel extension (which
- * represents a virtual keyboard).
+ * Posts the report for 1 usage page to the karabiner kernel extension
+ * (which represents a virtual keyboard).
  */
-extern "C" int send_key(struct KeyEvent *e) {
-    pqrs::karabiner_virtual_hid_device::usage_page usage_page = pqrs::karabiner_virtual_hid_device::usage_page(e->page);
+int post_report(uint32_t page, const std::vector<uint32_t> &usages) {
+    pqrs::karabiner_virtual_hid_device::usage_page usage_page = pqrs::karabiner_virtual_hid_device::usage_page(page);
     if(usage_page == pqrs::karabiner_virtual_hid_device::usage_page::keyboard_or_keypad)
-        return send_key(keyboard, e);
+        return post_report(keyboard, usages);
     else if(usage_page == pqrs::karabiner_virtual_hid_device::usage_page::apple_vendor_top_case)
-        return send_key(top_case, e);
+        return post_report(top_case, usages);
     else if(usage_page == pqrs::karabiner_virtual_hid_device::usage_page::apple_vendor_keyboard)
-        return send_key(apple_keyboard, e);
+        return post_report(apple_keyboard, usages);
     else if(usage_page == pqrs::karabiner_virtual_hid_device::usage_page::consumer)
-        return send_key(consumer, e);
+        return post_report(consumer, usages);
     else
         return 1;
 }
 
 /*
- * Reads a new key event from the pipe, blocking until a new event is
- * ready.
+ * Haskell calls this with a new key event to send back to the OS. The
+ * change is only recorded, and posted with the rest of its batch by
+ * flush_keys.
+ */
+extern "C" int send_key(struct KeyEvent *e) {
+    if(e->type > 1) return 1;
+    int (*post)(uint32_t, const std::vector<uint32_t> &) = post_report;
+    return reports.change(e->page, e->usage, e->type == 1, post);
+}
+
+/*
+ * Haskell calls this at the end of a batch of key events, to post 1
+ * report for every usage page that changed.
+ */
+extern "C" int flush_keys() {
+    int (*post)(uint32_t, const std::vector<uint32_t> &) = post_report;
+    return reports.flush(post);
+}
+
+/*
+ * Reads a new key event from the ring buffer, blocking until a new
+ * event is ready. Returns 0 once the source has been released.
  */
 extern "C" int wait_key(struct KeyEvent *e) {
-    return read(fd[0], e, sizeof(struct KeyEvent)) == sizeof(struct KeyEvent);
+    return events.wait_pop(*e);
 }
 
 /*
@@ -245,23 +266,21 @@ void monitor_kb(char *product) {
 /*
  * Opens and seizes input from each keyboard device whose product name
  * matches the parameter (if NULL is received, then it opens all
- * keyboard devices). Spawns a thread to receive asynchronous input
- * and opens a pipe for this thread to send key event data to the main
- * thread.
+ * keyboard devices). Spawns a thread to receive asynchronous input,
+ * which passes key event data to the main thread through a ring
+ * buffer.
  *
  * Loads a the karabiner kernel extension that will send key events
  * back to the OS.
  */
 extern "C" int grab_kb(char *product) {
     // Source
-    if (pipe(fd) == -1) {
-        std::cerr << "pipe error: " << errno << std::endl;
-        return errno;
-    }
     if(product) {
         prod = (char *)malloc(strlen(product) + 1);
         strcpy(prod, product);
     }
+    // The ring was closed by the previous release_kb, if any
+    events.reopen();
     thread = std::thread{monitor_kb, prod};
     // Sink
     kern_return_t kr;
@@ -327,15 +346,9 @@ extern "C" int release_kb() {
     }
     if(prod) {
         free(prod);
+        prod = nullptr;
     }
-    if (close(fd[0]) == -1) {
-        std::cerr << "close error: " << errno << std::endl;
-        retval = 1;
-    }
-    if (close(fd[1]) == -1) {
-        std::cerr << "close error: " << errno << std::endl;
-        retval = 1;
-    }
+    events.close();
     // Sink
     kr = pqrs::karabiner_virtual_hid_device_methods::reset_virtual_hid_keyboard(connect);
     if (kr != KERN_SUCCESS) {
@@ -0,0 +1,128 @@
+#ifndef KMONAD_SPSC_RING_HPP
+#define KMONAD_SPSC_RING_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+
+/*
+ * A bounded, lock-free, single-producer single-consumer ring buffer
+ * for handing events from an OS callback thread to the thread that
+ * Haskell reads from.
+ *
+ * Pushing and popping only touch the two indices, so as long as the
+ * consumer keeps up, crossing the thread boundary costs no syscalls.
+ * Only when the consumer finds the ring empty does it go to sleep on a
+ * condition variable, and only then does the producer pay for waking
+ * it up.
+ *
+ * N must be a power of 2. Exactly 1 thread may call push, and exactly
+ * 1 (other) thread may call pop and wait_pop.
+ */
+template<typename T, std::size_t N>
+class spsc_ring {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "spsc_ring size must be a power of 2");
+
+public:
+    /*
+     * Try to add an element, returning false if the ring is full.
+     */
+    bool try_push(const T &x) {
+        std::size_t t = tail.load(std::memory_order_relaxed);
+        if(t - head.load(std::memory_order_acquire) == N) return false;
+        buf[t & (N - 1)] = x;
+        tail.store(t + 1, std::memory_order_release);
+        wake();
+        return true;
+    }
+
+    /*
+     * Add an element, yielding until the consumer has made room. We
+     * never drop elements, since a lost key-release leaves a key stuck.
+     */
+    void push(const T &x) {
+        while(!try_push(x)) std::this_thread::yield();
+    }
+
+    /*
+     * Try to take an element, returning false if the ring is empty.
+     */
+    bool pop(T &x) {
+        std::size_t h = head.load(std::memory_order_relaxed);
+        if(h == tail.load(std::memory_order_acquire)) return false;
+        x = buf[h & (N - 1)];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    /*
+     * Take an element, sleeping until one is available. Returns false
+     * only once the ring has been closed and drained.
+     */
+    bool wait_pop(T &x) {
+        if(pop(x)) return true;
+        std::unique_lock<std::mutex> lock(mutex);
+        sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        cond.wait(lock, [this] {
+            return !empty() || closed.load(std::memory_order_acquire);
+        });
+        sleeping.store(false, std::memory_order_relaxed);
+        lock.unlock();
+        return pop(x);
+    }
+
+    /*
+     * Wake up the consumer and make wait_pop return false once the
+     * ring is empty.
+     */
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed.store(true, std::memory_order_release);
+        cond.notify_one();
+    }
+
+    /*
+     * Empty the ring and undo close, so that it can be used again.
+     * Only call this while neither thread uses the ring, like before
+     * starting the producer thread.
+     */
+    void reopen() {
+        std::lock_guard<std::mutex> lock(mutex);
+        head.store(0, std::memory_order_relaxed);
+        tail.store(0, std::memory_order_relaxed);
+        sleeping.store(false, std::memory_order_relaxed);
+        closed.store(false, std::memory_order_release);
+    }
+
+    bool empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+private:
+    /*
+     * Wake the consumer if it is (about to go) to sleep. The fences
+     * here and in wait_pop make sure that either we see sleeping, or
+     * the consumer sees our new tail, so a wakeup is never lost.
+     */
+    void wake() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(!sleeping.load(std::memory_order_relaxed)) return;
+        std::lock_guard<std::mutex> lock(mutex);
+        cond.notify_one();
+    }
+
+    // The indices only ever grow, and live on separate cache lines
+    alignas(64) std::atomic<std::size_t> head{0}; // Written by the consumer
+    alignas(64) std::atomic<std::size_t> tail{0}; // Written by the producer
+    alignas(64) T buf[N];
+
+    std::atomic<bool> sleeping{false};
+    std::atomic<bool> closed{false};
+    std::mutex mutex;
+    std::condition_variable cond;
+};
+
+#endif
@@ -0,0 +1,193 @@
+/*
+ * Tests and a benchmark for hid_report_builder.
+ *
+ * Run with no arguments to test, or with `bench` to measure the cost of
+ * recording and flushing a batch of key changes.
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "../hid_report.hpp"
+
+#define CHECK(c) do { \
+    if(!(c)) { \
+        std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #c); \
+        std::exit(1); \
+    } \
+} while(0)
+
+static const uint32_t keyboard = 0x07;
+static const uint32_t consumer = 0x0c;
+
+/*
+ * Records every report the builder posts.
+ */
+struct recorder {
+    struct report {
+        uint32_t page;
+        std::vector<uint32_t> usages;
+    };
+    std::vector<report> reports;
+    int ret = 0;
+
+    int operator()(uint32_t page, const std::vector<uint32_t> &usages) {
+        reports.push_back(report{page, usages});
+        return ret;
+    }
+};
+
+/*
+ * The builder takes post by value, so hand it a reference to a recorder.
+ */
+struct post_to {
+    recorder *r;
+    int operator()(uint32_t page, const std::vector<uint32_t> &usages) {
+        return (*r)(page, usages);
+    }
+};
+
+static bool same(const std::vector<uint32_t> &a, std::initializer_list<uint32_t> b) {
+    return a == std::vector<uint32_t>(b);
+}
+
+static void test_per_page() {
+    hid_report_builder b;
+    recorder r;
+    post_to p{&r};
+    b.change(keyboard, 4, true, p);
+    b.change(keyboard, 5, true, p);
+    b.change(consumer, 0xe9, true, p);
+    // Nothing is posted before the flush
+    CHECK(r.reports.empty());
+    CHECK(b.pending());
+    CHECK(b.flush(p) == 0);
+    CHECK(r.reports.size() == 2);
+    CHECK(r.reports[0].page == keyboard && same(r.reports[0].usages, {4, 5}));
+    CHECK(r.reports[1].page == consumer && same(r.reports[1].usages, {0xe9}));
+    CHECK(!b.pending());
+}
+
+static void test_one_report_per_flush() {
+    hid_report_builder b;
+    recorder r;
+    post_to p{&r};
+    // An empty flush posts nothing
+    b.flush(p);
+    CHECK(r.reports.empty());
+    b.change(keyboard, 4, true, p);
+    b.change(keyboard, 5, true, p);
+    b.change(keyboard, 6, true, p);
+    b.flush(p);
+    CHECK(r.reports.size() == 1);
+    // Only pages that changed are posted again
+    b.change(consumer, 0xe9, true, p);
+    b.flush(p);
+    CHECK(r.reports.size() == 2 && r.reports[1].page == consumer);
+    b.flush(p);
+    CHECK(r.reports.size() == 2);
+    // As is a page where nothing changed in effect
+    b.change(keyboard, 4, true, p);
+    b.change(keyboard, 7, false, p);
+    CHECK(!b.pending());
+}
+
+static void test_same_batch() {
+    hid_report_builder b;
+    recorder r;
+    post_to p{&r};
+    // A tap within 1 batch flushes the press before recording the release
+    b.change(keyboard, 4, true, p);
+    CHECK(r.reports.empty());
+    b.change(keyboard, 4, false, p);
+    CHECK(r.reports.size() == 1 && same(r.reports[0].usages, {4}));
+    b.flush(p);
+    CHECK(r.reports.size() == 2 && same(r.reports[1].usages, {}));
+
+    // Other usages in the batch go out with the early flush
+    r.reports.clear();
+    b.change(keyboard, 5, true, p);
+    b.change(keyboard, 6, true, p);
+    b.change(keyboard, 5, false, p);
+    b.change(keyboard, 5, true, p);
+    b.flush(p);
+    CHECK(r.reports.size() == 3);
+    CHECK(same(r.reports[0].usages, {5, 6}));
+    CHECK(same(r.reports[1].usages, {6}));
+    CHECK(same(r.reports[2].usages, {6, 5}));
+}
+
+static void test_overflow() {
+    hid_report_builder b;
+    recorder r;
+    post_to p{&r};
+    // More usages than a boot keyboard report has room for are all kept,
+    // in the order they were pressed
+    for(uint32_t u = 4; u < 12; u++) b.change(keyboard, u, true, p);
+    b.flush(p);
+    CHECK(r.reports.size() == 1);
+    CHECK(same(r.reports[0].usages, {4, 5, 6, 7, 8, 9, 10, 11}));
+    // Releasing 1 of them leaves the rest in order
+    b.change(keyboard, 6, false, p);
+    b.flush(p);
+    CHECK(same(r.reports[1].usages, {4, 5, 7, 8, 9, 10, 11}));
+    for(uint32_t u = 4; u < 12; u++) b.change(keyboard, u, false, p);
+    b.flush(p);
+    CHECK(r.reports.size() == 3 && same(r.reports[2].usages, {}));
+}
+
+static void test_post_result() {
+    hid_report_builder b;
+    recorder r;
+    post_to p{&r};
+    r.ret = 3;
+    b.change(keyboard, 4, true, p);
+    b.change(consumer, 0xe9, true, p);
+    // A failing post does not stop the other pages from being posted
+    CHECK(b.flush(p) == 3);
+    CHECK(r.reports.size() == 2);
+    CHECK(!b.pending());
+}
+
+/*
+ * Run n batches of a macro typing `len` characters with shift held,
+ * like the steps of a long KMonad macro, and report the time per batch.
+ */
+static void bench(unsigned long n, uint32_t len) {
+    hid_report_builder b;
+    unsigned long posts = 0;
+    auto post = [&posts](uint32_t, const std::vector<uint32_t> &) {
+        posts++;
+        return 0;
+    };
+    auto t0 = std::chrono::steady_clock::now();
+    for(unsigned long i = 0; i < n; i++) {
+        b.change(keyboard, 0xe1, true, post);
+        for(uint32_t u = 0; u < len; u++) {
+            b.change(keyboard, 4 + u % 26, true, post);
+            b.change(keyboard, 4 + u % 26, false, post);
+        }
+        b.change(keyboard, 0xe1, false, post);
+        b.flush(post);
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::printf("%3u keys per batch %10lu batches %8.1f reports/batch %10.0fns/batch\n",
+                len, n, double(posts) / n, secs * 1e9 / n);
+}
+
+int main(int argc, char **argv) {
+    if(argc > 1 && std::strcmp(argv[1], "bench") == 0) {
+        bench(1000000, 1);
+        bench(100000, 32);
+        return 0;
+    }
+    test_per_page();
+    test_one_report_per_flush();
+    test_same_batch();
+    test_overflow();
+    test_post_result();
+    std::printf("hid_report: ok\n");
+    return 0;
+}
@@ -0,0 +1,157 @@
+/*
+ * Tests and a benchmark for spsc_ring.
+ *
+ * The ring is only used by the Mac shim, but it is plain C++11, so it
+ * is checked here on Linux. Run with no arguments to test, or with
+ * `bench` to measure how fast events cross from 1 thread to another.
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#include "../spsc_ring.hpp"
+
+#define CHECK(c) do { \
+    if(!(c)) { \
+        std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #c); \
+        std::exit(1); \
+    } \
+} while(0)
+
+static void test_push_pop() {
+    spsc_ring<int, 4> r;
+    int x = 0;
+    CHECK(r.empty());
+    CHECK(!r.pop(x));
+    CHECK(r.try_push(1));
+    CHECK(r.try_push(2));
+    CHECK(!r.empty());
+    CHECK(r.pop(x) && x == 1);
+    CHECK(r.pop(x) && x == 2);
+    CHECK(!r.pop(x));
+    CHECK(r.empty());
+}
+
+static void test_full() {
+    spsc_ring<int, 4> r;
+    int x = 0;
+    for(int i = 0; i < 4; i++) CHECK(r.try_push(i));
+    CHECK(!r.try_push(4));
+    CHECK(r.pop(x) && x == 0);
+    CHECK(r.try_push(4));
+    // The indices wrap around the buffer, but keep their order
+    for(int i = 1; i <= 4; i++) CHECK(r.pop(x) && x == i);
+    CHECK(r.empty());
+}
+
+static void test_wait_pop_wakes() {
+    spsc_ring<int, 4> r;
+    int x = 0;
+    std::thread p([&r] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        r.push(7);
+    });
+    CHECK(r.wait_pop(x) && x == 7);
+    p.join();
+}
+
+static void test_close() {
+    spsc_ring<int, 4> r;
+    int x = 0;
+    r.push(1);
+    r.push(2);
+    r.close();
+    // Closing never loses what is still in the ring
+    CHECK(r.wait_pop(x) && x == 1);
+    CHECK(r.wait_pop(x) && x == 2);
+    CHECK(!r.wait_pop(x));
+
+    // A consumer that is already asleep is woken up
+    spsc_ring<int, 4> s;
+    std::thread c([&s] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        s.close();
+    });
+    CHECK(!s.wait_pop(x));
+    c.join();
+}
+
+static void test_reopen() {
+    spsc_ring<int, 4> r;
+    int x = 0;
+    r.push(1);
+    r.close();
+    r.reopen();
+    // Reopening drops what the last user left behind
+    CHECK(r.empty());
+    std::thread p([&r] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        r.push(2);
+    });
+    // Before reopen existed, this returned false right away
+    CHECK(r.wait_pop(x) && x == 2);
+    p.join();
+}
+
+static void test_order(unsigned long n) {
+    spsc_ring<unsigned long, 1024> r;
+    std::thread p([&r, n] {
+        for(unsigned long i = 0; i < n; i++) r.push(i);
+        r.close();
+    });
+    unsigned long x = 0, expect = 0;
+    while(r.wait_pop(x)) {
+        CHECK(x == expect);
+        expect++;
+    }
+    CHECK(expect == n);
+    p.join();
+}
+
+/*
+ * Push n events, pausing every burst events like a typist would, and
+ * report the time per event from push to pop.
+ */
+static void bench(unsigned long n, unsigned long burst) {
+    typedef std::chrono::steady_clock clock;
+    spsc_ring<clock::time_point, 1024> r;
+    std::thread p([&r, n, burst] {
+        for(unsigned long i = 0; i < n; i++) {
+            if(burst && i % burst == 0)
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            r.push(clock::now());
+        }
+        r.close();
+    });
+    clock::time_point t0 = clock::now(), t;
+    double lat = 0, worst = 0;
+    unsigned long k = 0;
+    while(r.wait_pop(t)) {
+        double d = std::chrono::duration<double, std::nano>(clock::now() - t).count();
+        lat += d;
+        if(d > worst) worst = d;
+        k++;
+    }
+    double secs = std::chrono::duration<double>(clock::now() - t0).count();
+    p.join();
+    std::printf("%-12s %10lu events %8.1f Mevents/s %10.0fns mean %10.0fns max\n",
+                burst ? "bursts" : "flat out", k, k / secs / 1e6, lat / k, worst);
+}
+
+int main(int argc, char **argv) {
+    if(argc > 1 && std::strcmp(argv[1], "bench") == 0) {
+        bench(10000000, 0);
+        bench(100000, 10);
+        return 0;
+    }
+    test_push_pop();
+    test_full();
+    test_wait_pop_wakes();
+    test_close();
+    test_reopen();
+    test_order(1000000);
+    std::printf("spsc_ring: ok\n");
+    return 0;
+}
@@ -0,0 +1,135 @@
+{-# LANGUAGE CPP #-}
+{-|
+Module      : KMonad.Dev
+Description : Run the test and benchmark harnesses on configs
+Copyright   : (c) David Janssen, 2019
+License     : MIT
+
+Maintainer  : janssen.dhj@gmail.com
+Stability   : experimental
+Portability : non-portable (MPTC with FD, FFI to Linux-only c-code)
+
+The harnesses replay, generate and stress input for configs, and only exist to
+develop KMonad itself. They live in their own executable, so that the @kmonad@
+users install stays small and only runs keyboards.
+
+-}
+module KMonad.Dev
+  ( run )
+where
+
+import KMonad.Prelude
+import KMonad.Args.Joiner
+import KMonad.Args.Parser
+import KMonad.Dev.Cmd
+import KMonad.Trace.Bench
+import KMonad.Trace.Generate
+import KMonad.Trace.Idle
+import KMonad.Trace.Replay
+import KMonad.Trace.Soak
+import KMonad.Trace.Stress
+
+import System.Environment (getExecutablePath)
+import UnliftIO.Process (callProcess)
+
+#ifdef linux_HOST_OS
+import KMonad.Keyboard.IO.Linux.Burst
+#endif
+
+--------------------------------------------------------------------------------
+--
+
+-- | Run one of the harnesses
+run :: IO ()
+run = getTask >>= \case
+  RunCompare a    -> runCompare a
+  RunGenerate w f -> writeWorkload w f
+  RunBench a      -> runBench a
+  RunStress a     -> runStress a
+  RunIdle a       -> runIdle a
+  RunSoak a       -> runSoak a
+  RunBurst r n    -> runBurst r n
+
+-- | Replay a trace through 2 configs and print the comparison to stdout. Only
+-- warnings are logged, to stderr, so the report stays readable.
+runCompare :: CompareCmd -> IO ()
+runCompare a = do
+  o <- logOptionsHandle stderr False <&> setLogMinLevel LevelWarn
+  withLogFunc o $ \f -> runRIO f $ do
+    ca <- joinConfigIO =<< loadTokens (a^.cmpCfgA)
+    cb <- joinConfigIO =<< loadTokens (a^.cmpCfgB)
+    r  <- compareTraces ca cb (a^.cmpTrace)
+    hPutBuilder stdout $ getUtf8Builder r
+
+-- | Benchmark configs on the generated scenarios and print a table to stdout.
+-- Without any configs, benchmark the ones that ship with KMonad.
+--
+-- When asked to compare runtime settings, we instead rerun ourselves once with
+-- each of them, since they can only be set when the program starts.
+runBench :: BenchCmd -> IO ()
+runBench a
+  | null (a^.benchRts) = do
+    o <- logOptionsHandle stderr False <&> setLogMinLevel LevelWarn
+    withLogFunc o $ \f -> runRIO f $ do
+      let ps = if null (a^.benchCfgs) then shippedConfigs else a^.benchCfgs
+      cs <- for ps $ \p -> (p,) <$> (joinConfigIO =<< loadTokens p)
+      r  <- benchConfigs (a^.benchKeys) (a^.benchLoad) cs
+      hPutBuilder stdout $ getUtf8Builder r
+  | otherwise = do
+    exe <- getExecutablePath
+    for_ (a^.benchRts) $ \r -> do
+      hPutBuilder stdout . getUtf8Builder $ "RTS options: " <> fromString r <> "\n"
+      hFlush stdout
+      callProcess exe $ ["+RTS"] <> words r <> ["-RTS", "bench"
+        , "--keys", show (a^.benchKeys), "--contention", show (a^.benchLoad)]
+        <> a^.benchCfgs
+      hPutBuilder stdout "\n"
+
+-- | Soak configs with a long run of random input and print the samples to
+-- stdout, failing if anything grew. Without any configs, soak the ones that
+-- ship with KMonad.
+runSoak :: SoakCmd -> IO ()
+runSoak a = do
+  o <- logOptionsHandle stderr False <&> setLogMinLevel LevelWarn
+  withLogFunc o $ \f -> runRIO f $ do
+    let ps = if null (a^.soakCfgs) then shippedConfigs else a^.soakCfgs
+    cs <- for ps $ \p -> (p,) <$> (joinConfigIO =<< loadTokens p)
+    (ok, r) <- soakConfigs (a^.soakRun) cs
+    hPutBuilder stdout $ getUtf8Builder r
+    unless ok exitFailure
+
+-- | Count wakeups of idle configs, time the first key after a gap, and print
+-- the tables to stdout. Without any
+-- configs, run the ones that ship with KMonad.
+runIdle :: IdleCmd -> IO ()
+runIdle a = do
+  o <- logOptionsHandle stderr False <&> setLogMinLevel LevelWarn
+  withLogFunc o $ \f -> runRIO f $ do
+    let ps = if null (a^.idleCfgs) then shippedConfigs else a^.idleCfgs
+    cs <- for ps $ \p -> (p,) <$> (joinConfigIO =<< loadTokens p)
+    r  <- idleBench (a^.idleRun) cs
+    hPutBuilder stdout $ getUtf8Builder r
+
+-- | Stress configs with random input and print a table to stdout, failing if
+-- any invariant was broken
+runStress :: StressCmd -> IO ()
+runStress a = do
+  o <- logOptionsHandle stderr False <&> setLogMinLevel LevelWarn
+  withLogFunc o $ \f -> runRIO f $ do
+    cs <- for (a^.stressCfgs) $ \p -> (p,) <$> (joinConfigIO =<< loadTokens p)
+    (ok, r) <- stressConfigs (a^.stressRun) cs
+    hPutBuilder stdout $ getUtf8Builder r
+    unless ok exitFailure
+
+-- | Write a burst of events through a uinput device, failing if any are lost
+runBurst :: Int -> Int -> IO ()
+#ifdef linux_HOST_OS
+runBurst r n = runSimpleApp $ do
+  (ok, t) <- burstBench r n
+  hPutBuilder stdout $ getUtf8Builder t
+  unless ok exitFailure
+#else
+runBurst _ _ = runSimpleApp $ do
+  logError "uinput-burst is only available on Linux"
+  exitFailure
+#endif
@@ -0,0 +1,215 @@
+{-|
+Module      : KMonad.Dev.Cmd
+Description : Parse command-line options for the development harnesses
+Copyright   : (c) David Janssen, 2019
+License     : MIT
+
+Maintainer  : janssen.dhj@gmail.com
+Stability   : experimental
+Portability : non-portable (MPTC with FD, FFI to Linux-only c-code)
+
+-}
+module KMonad.Dev.Cmd
+  ( Task(..)
+  , CompareCmd(..)
+  , HasCompareCmd(..)
+  , BenchCmd(..)
+  , HasBenchCmd(..)
+  , StressCmd(..)
+  , HasStressCmd(..)
+  , IdleCmd(..)
+  , HasIdleCmd(..)
+  , SoakCmd(..)
+  , HasSoakCmd(..)
+  , getTask
+  )
+where
+
+import KMonad.Prelude
+import KMonad.Args.Cmd (idleGCP)
+import KMonad.Trace.Generate
+import KMonad.Trace.Idle
+import KMonad.Trace.Soak
+import KMonad.Trace.Stress
+
+import Options.Applicative
+
+
+--------------------------------------------------------------------------------
+-- $cmd
+--
+-- The different harnesses kmonad-dev can run.
+
+-- | Record describing how to compare 2 configs on a trace
+data CompareCmd = CompareCmd
+  { _cmpTrace   :: FilePath           -- ^ The trace to replay
+  , _cmpCfgA    :: FilePath           -- ^ The first config
+  , _cmpCfgB    :: FilePath           -- ^ The second config
+  }
+  deriving Show
+makeClassy ''CompareCmd
+
+-- | Record describing how to benchmark configs on generated scenarios
+data BenchCmd = BenchCmd
+  { _benchCfgs  :: [FilePath]         -- ^ The configs to benchmark
+  , _benchKeys  :: Int                -- ^ How many keys to type per scenario
+  , _benchLoad  :: Int                -- ^ How many threads of background load
+  , _benchRts   :: [String]           -- ^ Runtime settings to compare
+  }
+  deriving Show
+makeClassy ''BenchCmd
+
+-- | Record describing how to stress configs with random input
+data StressCmd = StressCmd
+  { _stressCfgs :: [FilePath]         -- ^ The configs to stress
+  , _stressRun  :: Stress             -- ^ How to stress them
+  }
+  deriving Show
+makeClassy ''StressCmd
+
+-- | Record describing how to soak configs with a long run of random input
+data SoakCmd = SoakCmd
+  { _soakCfgs   :: [FilePath]         -- ^ The configs to soak
+  , _soakRun    :: Soak               -- ^ How to soak them
+  }
+  deriving Show
+makeClassy ''SoakCmd
+
+-- | Record describing how to count wakeups of idle configs
+data IdleCmd = IdleCmd
+  { _idleCfgs   :: [FilePath]         -- ^ The configs to run
+  , _idleRun    :: IdleBench          -- ^ What to measure
+  }
+  deriving Show
+makeClassy ''IdleCmd
+
+-- | The different harnesses kmonad-dev can be asked to run
+data Task
+  = RunCompare CompareCmd         -- ^ Replay a recorded trace through 2 configs
+  | RunGenerate Workload FilePath -- ^ Write a synthetic trace
+  | RunBench BenchCmd             -- ^ Benchmark configs on synthetic traces
+  | RunStress StressCmd           -- ^ Check invariants under random input
+  | RunIdle IdleCmd               -- ^ Count wakeups while idle
+  | RunSoak SoakCmd               -- ^ Check that long runs do not leak
+  | RunBurst Int Int              -- ^ Check no events are lost in a burst
+  deriving Show
+
+-- | Parse 'Task' from the evocation of this program
+getTask :: IO Task
+getTask = customExecParser (prefs showHelpOnEmpty) $ info (taskP <**> helper)
+  (  fullDesc
+  <> progDesc "Run the KMonad test and benchmark harnesses"
+  <> header   "kmonad-dev - the workshop behind the onion."
+  )
+
+
+--------------------------------------------------------------------------------
+-- $prs
+--
+-- The different command-line parsers
+
+-- | Parse one of the harnesses
+taskP :: Parser Task
+taskP = hsubparser
+  (  command "compare" (info (RunCompare <$> compareCmdP) $
+       progDesc "Replay a trace through 2 configs and compare their output and delays")
+  <> command "generate" (info (RunGenerate <$> workloadP <*> outP) $
+       progDesc "Write a trace of synthetic typing")
+  <> command "bench" (info (RunBench <$> benchCmdP) $
+       progDesc "Measure throughput and latency of configs on synthetic typing")
+  <> command "stress" (info (RunStress <$> stressCmdP) $
+       progDesc "Check that configs leave no keys pressed and keep up under random input")
+  <> command "soak" (info (RunSoak <$> soakCmdP) $
+       progDesc "Check that memory, threads and hooks stay flat over a long run of random input")
+  <> command "idle" (info (RunIdle <$> idleCmdP) $
+       progDesc "Count how often configs wake up while no input arrives (Linux)")
+  <> command "uinput-burst" (info (RunBurst <$> rateP <*> eventsP) $
+       progDesc "Write a burst of events through a uinput device, check that none are lost, and report latency and wakeups (Linux)")
+  )
+  where
+    outP    = strArgument (metavar "FILE" <> help "Where to write the trace")
+    rateP   = num "rate"   50000  "Events to write per second"
+    eventsP = num "events" 500000 "How many events to write"
+    num l d h = option auto (long l <> metavar "N" <> value d <> showDefault <> help h)
+
+-- | Parse the description of a synthetic typist
+workloadP :: Parser Workload
+workloadP = Workload
+  <$> num "wpm"       "N" (defWorkload^.wpm)       "Words (of 5 keys) per minute"
+  <*> num "rollover"  "N" (defWorkload^.rollover)  "Most letters held at once"
+  <*> num "modifiers" "F" (defWorkload^.modRate)   "Fraction of letters typed with shift"
+  <*> num "bursts"    "F" (defWorkload^.burstRate) "Fraction of words that arrive as a macro-like burst"
+  <*> keysP
+  <*> num "seed"      "N" (defWorkload^.seed)      "Seed for the random generator"
+  where
+    num l m d h = option auto (long l <> metavar m <> value d <> showDefault <> help h)
+
+-- | Parse how many keys to type
+keysP :: Parser Int
+keysP = option auto
+  (  long    "keys"
+  <> metavar "N"
+  <> value   (defWorkload^.keys)
+  <> showDefault
+  <> help    "How many keys to type"
+  )
+
+-- | Parse the benchmark command
+benchCmdP :: Parser BenchCmd
+benchCmdP = BenchCmd
+  <$> many (strArgument (metavar "CONFIG..." <> help "The configuration files to benchmark (default: the configs in keymap/, run from the source tree)"))
+  <*> keysP
+  <*> option auto
+    (  long    "contention"
+    <> metavar "N"
+    <> value   0
+    <> showDefault
+    <> help    "Run N threads of CPU and allocation load next to KMonad")
+  <*> many (strOption
+    (  long    "rts"
+    <> metavar "OPTS"
+    <> help    "Rerun the benchmark with these runtime settings, e.g. \"-N2 -qg\" (repeatable, to compare them)"))
+
+-- | Parse the stress command
+stressCmdP :: Parser StressCmd
+stressCmdP = StressCmd
+  <$> some (strArgument (metavar "CONFIG..." <> help "The configuration files to stress"))
+  <*> (Stress
+    <$> num "events"         "N" (defStress^.sEvents) "Random events to feed in per round"
+    <*> num "rate"           "N" (defStress^.sRate)   "Mean input rate in events per second"
+    <*> num "rounds"         "N" (defStress^.sRounds) "Rounds to run per config, each with the next seed"
+    <*> num "seed"           "N" (defStress^.sSeed)   "Seed of the first round"
+    <*> num "min-throughput" "N" (defStress^.sFloor)  "Fail below N events processed per second")
+  where
+    num l m d h = option auto (long l <> metavar m <> value d <> showDefault <> help h)
+
+-- | Parse the soak command
+soakCmdP :: Parser SoakCmd
+soakCmdP = SoakCmd
+  <$> many (strArgument (metavar "CONFIG..." <> help "The configuration files to soak (default: the configs in keymap/, run from the source tree)"))
+  <*> (Soak
+    <$> num "events" "N" (defSoak^.skEvents) "Random events to feed in per config"
+    <*> num "chunk"  "N" (defSoak^.skChunk)  "Events to feed in between samples"
+    <*> num "rate"   "N" (defSoak^.skRate)   "Mean input rate in events per second"
+    <*> num "seed"   "N" (defSoak^.skSeed)   "Seed of the first chunk"
+    <*> num "slack"  "F" (defSoak^.skSlack)  "Fraction by which the live bytes may grow")
+  where
+    num l m d h = option auto (long l <> metavar m <> value d <> showDefault <> help h)
+
+-- | Parse the idle benchmark command
+idleCmdP :: Parser IdleCmd
+idleCmdP = IdleCmd
+  <$> many (strArgument (metavar "CONFIG..." <> help "The configuration files to run (default: the configs in keymap/, run from the source tree)"))
+  <*> (IdleBench
+    <$> num "seconds" (defIdleBench^.ibSeconds) "How many seconds to stay idle"
+    <*> num "keys"    (defIdleBench^.ibKeys)    "How many keys to type, each after a gap"
+    <*> idleGCP)
+  where
+    num l d h = option auto (long l <> metavar "N" <> value d <> showDefault <> help h)
+
+-- | Parse the trace-comparison command
+compareCmdP :: Parser CompareCmd
+compareCmdP = CompareCmd
+  <$> strArgument (metavar "TRACE"   <> help "The trace file to replay")
+  <*> strArgument (metavar "CONFIG_A" <> help "The first configuration file")
+  <*> strArgument (metavar "CONFIG_B" <> help "The second configuration file")
@@ -0,0 +1,128 @@
+{-|
+Module      : KMonad.Keyboard.IO.Linux.Burst
+Description : A burst benchmark of the uinput sink
+Copyright   : (c) David Janssen, 2019
+License     : MIT
+Maintainer  : janssen.dhj@gmail.com
+Stability   : experimental
+Portability : non-portable (Linux-only, needs access to /dev/uinput)
+
+Writes a long burst of events through a real 'uinputSink' at a fixed rate,
+while reading them back from the input device the kernel creates for it, to
+check that no event is lost on the way. The device is grabbed while we read it,
+so none of the burst reaches any other program.
+
+This goes through the kernel both ways, with the same device IO as KMonad
+itself, so it also shows what the runtime costs. Next to the events lost, we
+report the latency of every event from the moment we start writing it to the
+moment it is read back, and how often the threads of the process were woken up
+(see 'wakeups'). Running it at a typing rate (say @--rate 20@) on a threaded
+and on a non-threaded build (see the @threaded@ cabal flag) compares the two.
+
+-}
+module KMonad.Keyboard.IO.Linux.Burst
+  ( burstBench
+  )
+where
+
+import KMonad.Prelude
+
+import Control.Concurrent (rtsSupportsBoundThreads)
+import GHC.Clock (getMonotonicTimeNSec)
+import RIO.FilePath ((</>))
+import RIO.List (isPrefixOf)
+import Text.Printf (printf)
+
+import KMonad.App.Idle (wakeups)
+import KMonad.Keyboard
+import KMonad.Keyboard.IO
+import KMonad.Keyboard.IO.Linux.DeviceSource
+import KMonad.Keyboard.IO.Linux.UinputSink
+import KMonad.Trace.Replay
+
+import qualified RIO.Directory as D
+import qualified RIO.Text      as T
+
+-- | The name of the device we create
+burstName :: String
+burstName = "KMonad burst benchmark"
+
+-- | Find the event device of the input device with a name, giving udev up to
+-- a second to create it.
+findDevice :: HasLogFunc e => String -> RIO e FilePath
+findDevice n = go (100 :: Int)
+  where
+    go 0 = throwString $ "Could not find the input device for: " <> n
+    go k = do
+      es <- filter ("event" `isPrefixOf`) <$> D.listDirectory "/sys/class/input"
+      ms <- flip filterM es $ \e -> do
+        nm <- tryAny . readFileUtf8 $ "/sys/class/input" </> e </> "device/name"
+        ex <- D.doesFileExist $ "/dev/input" </> e
+        pure $ ex && either (const False) ((== T.pack n) . T.strip) nm
+      case ms of
+        e:_ -> pure $ "/dev/input" </> e
+        []  -> threadDelay 10000 >> go (k - 1)
+
+-- | Write a number of events at a rate in events per second, alternating
+-- presses and releases of F24, and count how many of them arrive and how long
+-- each took. Returns a description of the result, and whether every event
+-- arrived.
+burstBench :: HasLogFunc e
+  => Int -- ^ The rate in events per second
+  -> Int -- ^ The number of events to write
+  -> RIO e (Bool, Utf8Builder)
+burstBench rate n = do
+  snkA <- uinputSink defUinputCfg { _keyboardName = burstName }
+  with snkA $ \snk -> do
+    dev  <- findDevice burstName
+    srcA <- deviceSourceNative dev
+    with srcA $ \src -> do
+      got <- newTVarIO (0 :: Int)
+      lat <- newIORef noLatency
+      -- When each event still on its way was written, oldest first
+      sent <- newTQueueIO
+      let readBack = do
+            _ <- awaitKey src
+            t <- liftIO getMonotonicTimeNSec
+            atomically (tryReadTQueue sent) >>= traverse_ (\s ->
+              modifyIORef' lat (addLatency $ t - s))
+            atomically $ modifyTVar' got (+1)
+      withAsync (forever readBack) $ \_ -> do
+        w0 <- liftIO wakeups
+        t0 <- liftIO getMonotonicTimeNSec
+        -- Write everything that is due, as 1 batch, then sleep until the next
+        -- event is due, so that we add as few wakeups as we can
+        let go i = when (i < n) $ do
+              t <- liftIO getMonotonicTimeNSec
+              let due = min n . fromIntegral $ (t - t0) * fromIntegral rate `div` 1000000000
+              let at  = t0 + fromIntegral (i + 1) * 1000000000 `div` fromIntegral rate
+              if due <= i then threadDelay (fromIntegral $ (max t at - t) `div` 1000 + 1) >> go i else do
+                -- Stamped before the first write, so the reader never misses 1
+                atomically . for_ [i .. due - 1] . const $ writeTQueue sent t
+                for_ [i .. due - 1] $ \j ->
+                  emitKey snk $ bool mkRelease mkPress (even j) KeyF24
+                flushKeys snk
+                go due
+        go 0
+        t1 <- liftIO getMonotonicTimeNSec
+
+        -- Give the reader up to a second to catch up
+        _  <- timeout 1000000 . atomically $ readTVar got >>= checkSTM . (>= n)
+        w1 <- liftIO wakeups
+        m  <- readTVarIO got
+        l  <- readIORef lat
+        let secs = fromIntegral (t1 - t0) / 1e9 :: Double
+        let (_, mean, x) = latencyStats l
+        let us ns = fromIntegral ns / 1000 :: Double
+        pure . (m == n,) . fromString . mconcat $
+          [ printf "runtime: %s\n" $
+              if rtsSupportsBoundThreads then "threaded" else "non-threaded" :: String
+          , printf "wrote %d events in %.3fs (%.0f events/s), read back %d, lost %d\n"
+              n secs (fromIntegral n / max 1e-9 secs) m (n - m)
+          , printf "latency: mean %.1fus, p50 %.1fus, p99 %.1fus, max %.1fus\n"
+              (us mean) (us $ latencyPercentile 0.5 l) (us $ latencyPercentile 0.99 l) (us x)
+          , case (-) <$> w1 <*> w0 of
+              Nothing -> "wakeups: unavailable\n"
+              Just w  -> printf "wakeups: %d (%.2f per event)\n"
+                           w (fromIntegral w / fromIntegral (max 1 n) :: Double)
+          ]
@@ -0,0 +1,119 @@
+{-|
+Module      : KMonad.Trace.Bench
+Description : Scenario benchmarks of the full app-loop
+Copyright   : (c) David Janssen, 2019
+License     : MIT
+Maintainer  : janssen.dhj@gmail.com
+Stability   : experimental
+Portability : portable
+
+Runs a set of generated typing scenarios (see "KMonad.Trace.Generate") through
+the full app-loop of 1 or more configs, with in-memory IO and a virtual clock
+(see "KMonad.Trace.Replay"), and reports how fast KMonad processes them.
+
+Since the clock is virtual, none of the time is spent waiting: throughput is
+the number of input events processed per second of real time, and latency is
+the real time between feeding in 1 event and KMonad having finished all the
+work it causes, including emitting the output.
+
+To see how KMonad copes with a busy machine, the scenarios can run under
+contention: next to KMonad, a number of threads keep the CPU busy, half of them
+by computing and half of them by allocating short-lived data, which keeps the
+garbage collector busy too. This is where the tail of the latency (p99.9) and
+the runtime settings start to matter.
+
+-}
+module KMonad.Trace.Bench
+  ( scenarios
+  , shippedConfigs
+  , withContention
+  , benchConfigs
+  )
+where
+
+import KMonad.Prelude
+
+import RIO.Text (unpack)
+import Text.Printf (printf)
+
+import KMonad.Args.Types
+import KMonad.Trace.Generate
+import KMonad.Trace.Replay
+
+import qualified Control.Concurrent as C
+
+--------------------------------------------------------------------------------
+-- $scenarios
+
+-- | The scenarios we benchmark, each typing a number of keys
+scenarios :: Int -> [(Text, Workload)]
+scenarios n =
+  [ ("prose",        Workload  60 1 0.05 0   n 1)
+  , ("fast rolls",   Workload 120 4 0.05 0   n 2)
+  , ("modifiers",    Workload  70 2 0.40 0   n 3)
+  , ("macro bursts", Workload  60 2 0.05 0.3 n 4)
+  ]
+
+-- | The configs that ship with KMonad, relative to the root of the source tree.
+-- These are benchmarked when no config is given.
+shippedConfigs :: [FilePath]
+shippedConfigs =
+  [ "keymap/tutorial.kbd"
+  , "keymap/user/david-janssen/atreus.kbd"
+  , "keymap/user/MaxGyver83/neo.kbd"
+  ]
+
+
+--------------------------------------------------------------------------------
+-- $contention
+
+-- | Run an action with a number of threads of background load, alternating
+-- between threads that compute and threads that allocate.
+withContention :: MonadUnliftIO m => Int -> m a -> m a
+withContention n a
+  | n <= 0    = a
+  | otherwise = withAsync (liftIO $ load n) $ \_ -> withContention (n - 1) a
+  where
+    -- The computing threads yield after every round, since a loop that never
+    -- allocates would also never let the garbage collector start.
+    load :: Int -> IO ()
+    load k
+      | even k    = let go i = evaluate (foldl' (+) i [1 .. 100000]) >>= \j -> C.yield >> go j
+                    in go k
+      | otherwise = let go i = evaluate (length $ show [i .. i + 1000]) >>= go . (+ i)
+                    in go k
+
+
+--------------------------------------------------------------------------------
+-- $bench
+
+-- | Run all 'scenarios' of a number of keys through every config, and describe
+-- the results.
+benchConfigs :: HasLogFunc e
+  => Int                      -- ^ The number of keys to type per scenario
+  -> Int                      -- ^ The number of threads of background load
+  -> [(FilePath, CfgToken)]   -- ^ The configs to benchmark, with their names
+  -> RIO e Utf8Builder
+benchConfigs n l cs = fmap ((header <>) . mconcat) . for (scenarios n) $ \(s, w) ->
+  withContention l . withSystemTempFile "kmonad-bench.trace" $ \f h -> do
+    hClose h
+    writeWorkload w f
+    fmap mconcat . for cs $ \(p, c) -> line s p <$> replayTrace c f (const $ pure ())
+  where
+    header = fromString $
+      printf "%-14s %-30s %10s %12s %10s %10s %10s %10s\n"
+        ("scenario" :: String) ("config" :: String) ("events" :: String)
+        ("events/s" :: String) ("mean" :: String) ("p99" :: String)
+        ("p99.9" :: String) ("max" :: String)
+
+    line s p r =
+      let l         = r^.rLatency
+          (k, m, x) = latencyStats l
+          secs      = fromIntegral (r^.rWallTime) / 1e9 :: Double
+      in fromString $ printf "%-14s %-30s %10d %12.0f %10s %10s %10s %10s\n"
+           (unpack s) p k (fromIntegral k / max 1e-9 secs)
+           (us m) (us $ latencyPercentile 0.99 l)
+           (us $ latencyPercentile 0.999 l) (us x)
+
+    us :: Word64 -> String
+    us ns = printf "%.1fus" (fromIntegral ns / 1000 :: Double)
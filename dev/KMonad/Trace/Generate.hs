@@ -0,0 +1,176 @@
+{-|
+Module      : KMonad.Trace.Generate
+Description : Synthetic typing workloads
+Copyright   : (c) David Janssen, 2019
+License     : MIT
+Maintainer  : janssen.dhj@gmail.com
+Stability   : experimental
+Portability : portable
+
+Generates traces (see "KMonad.Trace") that look like someone typing, so that
+KMonad can be exercised with realistic input without recording any. A
+'Workload' describes the typist: how fast they type, how many letters they
+roll over at once, how often they hold shift, and how often a word arrives all
+at once, like the output of a macro.
+
+Generation is deterministic for a given seed, and streams its events out one
+at a time, so workloads of any length take constant memory.
+
+-}
+module KMonad.Trace.Generate
+  ( -- * Workloads
+    Workload(..)
+  , HasWorkload(..)
+  , defWorkload
+
+    -- * Generating
+  , generate
+  , writeWorkload
+  , splitmix
+  )
+where
+
+import KMonad.Prelude
+
+import Data.Bits (shiftR, xor)
+
+import KMonad.Keyboard
+import KMonad.Trace
+
+import qualified RIO.ByteString as B
+import qualified RIO.Map        as M
+
+--------------------------------------------------------------------------------
+-- $workload
+
+-- | A description of someone typing
+data Workload = Workload
+  { _wpm       :: !Int    -- ^ Typing speed in words (of 5 letters) per minute
+  , _rollover  :: !Int    -- ^ The most letters held at the same time
+  , _modRate   :: !Double -- ^ Fraction of letters typed with shift held
+  , _burstRate :: !Double -- ^ Fraction of words that arrive as a burst
+  , _keys      :: !Int    -- ^ How many keys to type
+  , _seed      :: !Word64 -- ^ Seed for the random number generator
+  } deriving (Eq, Show)
+makeClassy ''Workload
+
+-- | A moderately fast typist that rarely rolls over and rarely uses shift
+defWorkload :: Workload
+defWorkload = Workload 60 2 0.05 0 10000 1
+
+-- | Letters in order of how common they are in English. We draw them with a
+-- skewed distribution, so the front of the list comes up most.
+alphabet :: [Keycode]
+alphabet =
+  [ KeyE, KeyT, KeyA, KeyO, KeyI, KeyN, KeyS, KeyH, KeyR, KeyD, KeyL, KeyC
+  , KeyU, KeyM, KeyW, KeyF, KeyG, KeyY, KeyP, KeyB, KeyV, KeyK, KeyJ, KeyX
+  , KeyQ, KeyZ ]
+
+
+--------------------------------------------------------------------------------
+-- $gen
+
+-- | The state of the generator
+data Gen = Gen
+  { _rng      :: !Word64                         -- ^ splitmix64 state
+  , _now      :: !Word64                         -- ^ Current time in microseconds
+  , _nextId   :: !Int                            -- ^ Keeps release keys unique
+  , _held     :: !(M.Map Keycode (Word64, Int))  -- ^ Held keys and their release
+  , _releases :: !(M.Map (Word64, Int) Keycode)  -- ^ Scheduled releases in order
+  }
+makeLenses ''Gen
+
+-- | Draw a number in [0, 1) from a splitmix64 state, returning the next state
+splitmix :: Word64 -> (Double, Word64)
+splitmix r = (fromIntegral (z3 `shiftR` 11) / 9007199254740992, s)
+  where
+    s  = r + 0x9e3779b97f4a7c15
+    z1 = (s  `xor` (s  `shiftR` 30)) * 0xbf58476d1ce4e5b9
+    z2 = (z1 `xor` (z1 `shiftR` 27)) * 0x94d049bb133111eb
+    z3 =  z2 `xor` (z2 `shiftR` 31)
+
+-- | Draw a number in [0, 1) using splitmix64
+uniform :: Gen -> (Double, Gen)
+uniform g = let (u, r) = splitmix (g^.rng) in (u, g & rng .~ r)
+
+-- | Return True with a probability
+chance :: Double -> Gen -> (Bool, Gen)
+chance p g = let (u, g') = uniform g in (u < p, g')
+
+-- | Pass every event of a 'Workload' to a callback, in order of time
+generate :: Monad m => Workload -> (TraceEvent -> m ()) -> m ()
+generate w out = go (w^.keys) (Gen (w^.seed) 0 0 M.empty M.empty)
+  where
+    -- The average time between keys in microseconds
+    base = 12000000 / fromIntegral (max 1 $ w^.wpm) :: Double
+    roll = fromIntegral . max 1 $ w^.rollover :: Double
+
+    emit t e = out $ TraceEvent t e
+
+    go n g
+      | n <= 0    = void $ releaseUntil maxBound g
+      | otherwise = do
+          -- A word is 5 letters and a space
+          let (b, g') = chance (w^.burstRate) g
+          let ks      = take n $ replicate 5 Nothing <> [Just KeySpace]
+          g'' <- foldM (key b) g' ks
+          go (n - length ks) g''
+
+    -- Draw a letter, with the most common ones most likely
+    letter g = let (u, g') = uniform g in
+      (fromMaybe KeyE $ alphabet ^? ix (floor $ u * u * 26), g')
+
+    -- Type 1 key (or a random letter): wait, release what is due, and press it
+    key burst g mk = do
+      let (k, g0)  = maybe (letter g) (, g) mk
+      let (u1, g1) = uniform g0
+      let gap      = if burst then 1000 else round $ base * (0.5 + u1)
+      g2 <- advance (g1^.now + gap) g1
+      -- Never press a key that is still down, nor exceed the rollover
+      g3 <- maybe (pure g2) (const $ release k g2) $ M.lookup k (g2^.held)
+      g4 <- if M.size (M.delete KeyLeftShift $ g3^.held) >= max 1 (w^.rollover)
+              then earliest g3 else pure g3
+      let (sh, g5) = chance (w^.modRate) g4
+      let shifted  = sh && not burst && k /= KeySpace
+                        && not (M.member KeyLeftShift $ g5^.held)
+      g6 <- if not shifted then pure g5 else do
+        emit (g5^.now) $ mkPress KeyLeftShift
+        advance (g5^.now + 5000) g5
+      emit (g6^.now) $ mkPress k
+      let (u2, g7) = uniform g6
+      let hold     = if burst then 500 else round $ base * (0.3 + u2 * (roll - 0.3))
+      let g8       = schedule k (g7^.now + hold) g7
+      pure $ if shifted then schedule KeyLeftShift (g8^.now + hold + 3000) g8 else g8
+
+    -- Move time forward, releasing everything that is due on the way
+    advance t g = (now .~ t) <$> releaseUntil t g
+
+    releaseUntil t g = case M.lookupMin (g^.releases) of
+      Just ((r, i), k) | r <= t -> do
+        emit r $ mkRelease k
+        releaseUntil t $ g & releases %~ M.delete (r, i) & held %~ M.delete k
+      _ -> pure g
+
+    -- Release a held key right now
+    release k g = case M.lookup k (g^.held) of
+      Nothing -> pure g
+      Just r  -> do
+        emit (g^.now) $ mkRelease k
+        pure $ g & releases %~ M.delete r & held %~ M.delete k
+
+    -- Release the letter that was due to be released first
+    earliest g = case M.lookupMin . M.filter (/= KeyLeftShift) $ g^.releases of
+      Nothing     -> pure g
+      Just (_, k) -> release k g
+
+    schedule k t g = g
+      & nextId   +~ 1
+      & releases %~ M.insert (t, g^.nextId) k
+      & held     %~ M.insert k (t, g^.nextId)
+
+-- | Write a 'Workload' to a trace file
+writeWorkload :: MonadUnliftIO m => Workload -> FilePath -> m ()
+writeWorkload w f = withBinaryFile f WriteMode $ \h -> do
+  hSetBuffering h $ BlockBuffering Nothing
+  liftIO $ B.hPut h traceHeader
+  generate w $ writeEvent h
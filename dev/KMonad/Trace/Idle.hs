@@ -0,0 +1,186 @@
+{-|
+Module      : KMonad.Trace.Idle
+Description : Measuring what KMonad does while nothing happens
+Copyright   : (c) David Janssen, 2019
+License     : MIT
+Maintainer  : janssen.dhj@gmail.com
+Stability   : experimental
+Portability : non-portable (counts wakeups through Linux's /proc)
+
+Runs the full app-loop of a config on the real clock, with in-memory IO (see
+"KMonad.Keyboard.IO.Memory"), and measures 2 things:
+
+  1. How often the process is woken up while no input arrives at all. An idle
+     KMonad should not wake up, apart from the 1 idle GC per idle period (see
+     "KMonad.App.Idle"). The count includes the wakeup that ends the
+     measurement itself.
+  2. How long the first key after a gap in typing takes to come out, with and
+     without the idle GC. Every gap is long enough for the idle GC to run in it.
+     The key is 1 that the config does not bind, and is passed through
+     unchanged, so this times the app-loop itself rather than any button.
+
+-}
+module KMonad.Trace.Idle
+  ( IdleBench(..)
+  , HasIdleBench(..)
+  , defIdleBench
+  , idleBench
+  )
+where
+
+import KMonad.Prelude
+
+import GHC.Clock (getMonotonicTimeNSec)
+import Text.Printf (printf)
+
+import KMonad.App
+import KMonad.App.Clock (realClock)
+import KMonad.App.Idle (wakeups)
+import KMonad.Args.Types
+import KMonad.Keyboard
+import KMonad.Keyboard.IO.Memory
+import KMonad.Trace.Replay
+import KMonad.Util
+
+import qualified Data.LayerStack as Ls
+import qualified RIO.HashMap     as HM
+
+--------------------------------------------------------------------------------
+-- $bench
+
+-- | A description of an idle benchmark
+data IdleBench = IdleBench
+  { _ibSeconds :: !Int                  -- ^ How long to stay idle
+  , _ibKeys    :: !Int                  -- ^ How many keys to type after a gap
+  , _ibGC      :: !(Maybe Milliseconds) -- ^ The idle GC delay to run with
+  } deriving (Eq, Show)
+makeClassy ''IdleBench
+
+-- | 10 seconds of idling, and 30 keys, with the default idle GC delay
+defIdleBench :: IdleBench
+defIdleBench = IdleBench 10 30 (Just 200)
+
+-- | A config running with in-memory IO on the real clock, with the queues to
+-- write its input to and read its output from
+data MemApp = MemApp
+  { _maCfg :: AppCfg
+  , _maIn  :: TQueue KeyEvent
+  , _maOut :: TQueue KeyEvent
+  }
+makeLenses ''MemApp
+
+-- | Build the 'AppCfg' to run a config with in-memory IO on the real clock
+memApp :: HasLogFunc e
+  => Maybe Milliseconds -- ^ The idle GC delay
+  -> CfgToken           -- ^ The config to run
+  -> RIO e MemApp
+memApp gc c = do
+  inq  <- newTQueueIO
+  outq <- newTQueueIO
+  src  <- memSource inq
+  snk  <- memSink outq
+  let app = AppCfg
+        { _keySinkDev    = snk
+        , _keySourceDev  = src
+        , _keymapCfg     = c^.km
+        , _firstLayer    = c^.fstL
+        , _fallThrough   = True -- To pass on the unbound key we type
+        , _allowCmd      = False
+        , _watchdogDelay = Nothing
+        , _eventMarkers  = False
+        , _perfCounters  = False
+        , _idleGC        = gc
+        , _idleWakeups   = False
+        , _heatmapFile   = Nothing
+        , _traceFile     = Nothing
+        , _tapInput      = Nothing
+        , _tapOutput     = Nothing
+        , _clock         = realClock
+        }
+  pure $ MemApp app inq outq
+
+-- | Run a config, and let it settle for a second before running an action
+withMemApp :: HasLogFunc e
+  => Maybe Milliseconds -> CfgToken -> (MemApp -> RIO e a) -> RIO e a
+withMemApp gc c f = do
+  m <- memApp gc c
+  withAsync (startApp $ m^.maCfg) $ \a -> do
+    link a
+    threadDelay 1000000
+    f m
+
+-- | Count the wakeups during a number of seconds without input, returning the
+-- count and the real number of seconds
+idleWakeups :: HasLogFunc e
+  => Int -> Maybe Milliseconds -> CfgToken -> RIO e (Maybe Int, Double)
+idleWakeups n gc c = withMemApp gc c $ \_ -> do
+  w0 <- liftIO wakeups
+  t0 <- liftIO getMonotonicTimeNSec
+  threadDelay $ n * 1000000
+  t1 <- liftIO getMonotonicTimeNSec
+  w1 <- liftIO wakeups
+  pure ((-) <$> w1 <*> w0, fromIntegral (t1 - t0) / 1e9)
+
+-- | Tap a key a number of times, each after a gap, and time how long each press
+-- takes to come out
+gapLatency :: HasLogFunc e
+  => Int -> Maybe Milliseconds -> Keycode -> CfgToken -> RIO e Latency
+gapLatency n gc k c = withMemApp gc c $ \m ->
+  foldM (\l _ -> tapKey m >>= \ns -> pure $ addLatency ns l) noLatency [1..n]
+  where
+    -- Long enough for the idle GC to run
+    gap = 1000 * (100 + maybe 200 fromIntegral gc)
+    tapKey m = do
+      threadDelay gap
+      t0 <- liftIO getMonotonicTimeNSec
+      atomically . writeTQueue (m^.maIn) $ mkPress k
+      _  <- atomically . readTQueue $ m^.maOut
+      t1 <- liftIO getMonotonicTimeNSec
+      atomically . writeTQueue (m^.maIn) $ mkRelease k
+      _  <- atomically . readTQueue $ m^.maOut
+      pure $ t1 - t0
+
+-- | A key that a config does not bind in any layer
+unboundKey :: CfgToken -> Keycode
+unboundKey c = fromMaybe KeyF24 . find (not . (`elem` bound)) $
+  [KeyF24, KeyF23, KeyF22, KeyF21, KeyF20, KeyF19, KeyF18, KeyF17, KeyF16]
+  where bound = map snd . HM.keys $ c^.km . Ls.items
+
+-- | Run the idle benchmark on every config, and describe the results
+idleBench :: HasLogFunc e
+  => IdleBench              -- ^ The benchmark to run
+  -> [(FilePath, CfgToken)] -- ^ The configs to run, with their names
+  -> RIO e Utf8Builder
+idleBench b cs = do
+  ws <- for cs $ \(p, c) -> wakeLine p <$> idleWakeups (b^.ibSeconds) (b^.ibGC) c
+  -- Without the idle GC first, then with it
+  let gcs = Nothing : maybe [] (pure . Just) (b^.ibGC)
+  ls <- for cs $ \(p, c) -> for gcs $ \gc ->
+    latLine p gc <$> gapLatency (b^.ibKeys) gc (unboundKey c) c
+  pure . mconcat $
+    [ "wakeups while idle:\n", wakeHeader, mconcat ws
+    , "\nlatency of the first key after a gap:\n", latHeader, mconcat $ concat ls
+    ]
+  where
+    na = "-" :: String
+
+    wakeHeader = fromString $
+      printf "%-30s %8s %10s %12s\n"
+        ("config" :: String) ("seconds" :: String) ("wakeups" :: String)
+        ("per second" :: String)
+    wakeLine p (mw, secs) = fromString $ case mw of
+      Nothing -> printf "%-30s %8.1f %10s %12s\n" p secs na na
+      Just w  -> printf "%-30s %8.1f %10d %12.2f\n" p secs w (fromIntegral w / secs)
+
+    latHeader = fromString $
+      printf "%-30s %8s %8s %10s %10s %10s\n"
+        ("config" :: String) ("idle-gc" :: String) ("keys" :: String)
+        ("p50" :: String) ("p99" :: String) ("max" :: String)
+    latLine p gc l =
+      let (k, _, x) = latencyStats l
+      in fromString $ printf "%-30s %8s %8d %10s %10s %10s\n"
+           p (maybe "off" (\d -> show (fromIntegral d :: Int) <> "ms") gc) k
+           (us $ latencyPercentile 0.5 l) (us $ latencyPercentile 0.99 l) (us x)
+
+    us :: Word64 -> String
+    us ns = printf "%.1fus" (fromIntegral ns / 1000 :: Double)
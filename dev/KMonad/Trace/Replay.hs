@@ -0,0 +1,295 @@
+{-# LANGUAGE BangPatterns #-}
+{-|
+Module      : KMonad.Trace.Replay
+Description : Replaying traces through configs with a virtual clock
+Copyright   : (c) David Janssen, 2019
+License     : MIT
+Maintainer  : janssen.dhj@gmail.com
+Stability   : experimental
+Portability : portable
+
+Replays a trace (see "KMonad.Trace") through the full app-loop of a config,
+with in-memory IO and a 'VirtualClock'. Before each event is fed in, time is
+moved to the moment it was recorded, running every timeout that expires on the
+way, and KMonad is given the chance to finish reacting to everything before it.
+This makes a replay exact and repeatable: it does not depend on the speed of the
+machine, and a trace of an hour of typing replays in seconds.
+
+Replaying the same trace through 2 configs at the same time lets us compare
+them: what they emit, and how long each key is buffered before anything comes
+out. The buffering delay of a press is the virtual time between the press and
+the first output after it, which is where the cost of a button like
+@tap-hold-next-release@ shows up.
+
+-}
+module KMonad.Trace.Replay
+  ( loopThreads
+  , Output
+  , Delay(..)
+  , HasDelay(..)
+  , Latency
+  , noLatency
+  , addLatency
+  , latencyStats
+  , latencyPercentile
+  , Replayed(..)
+  , HasReplayed(..)
+  , replayTrace
+  , compareTraces
+  )
+where
+
+import KMonad.Prelude
+
+import Data.Bits (countLeadingZeros)
+import GHC.Clock (getMonotonicTimeNSec)
+import Text.Printf (printf)
+
+import KMonad.App
+import KMonad.App.Clock
+import KMonad.Args.Types
+import KMonad.Keyboard
+import KMonad.Keyboard.IO
+import KMonad.Trace
+
+import qualified RIO.Map as M
+
+--------------------------------------------------------------------------------
+-- $replay
+
+-- | An event emitted at a virtual time, in microseconds
+type Output = (Word64, KeyEvent)
+
+-- | The threads of the app-loop that are not started with 'spawn': the loop
+-- itself and the emitter.
+loopThreads :: Int
+loopThreads = 2
+
+-- | The buffering delays of the presses of 1 key
+data Delay = Delay
+  { _dCount :: !Int
+  , _dSum   :: !Word64 -- ^ In microseconds
+  , _dMax   :: !Word64 -- ^ In microseconds
+  }
+makeClassy ''Delay
+
+-- | The real time taken to react to input events, in nanoseconds, with a
+-- histogram in power-of-2 bins.
+data Latency = Latency
+  { _lCount :: !Int
+  , _lSum   :: !Word64
+  , _lMax   :: !Word64
+  , _lBins  :: !(M.Map Int Int)
+  }
+
+-- | A 'Latency' without any measurements
+noLatency :: Latency
+noLatency = Latency 0 0 0 M.empty
+
+-- | Add 1 measurement to a 'Latency'
+addLatency :: Word64 -> Latency -> Latency
+addLatency ns (Latency n s m bs) = Latency (n + 1) (s + ns) (max m ns)
+  (M.insertWith (+) (64 - countLeadingZeros ns) 1 bs)
+
+-- | Return the count, mean and maximum of a 'Latency'
+latencyStats :: Latency -> (Int, Word64, Word64)
+latencyStats (Latency n s m _) = (n, s `div` fromIntegral (max 1 n), m)
+
+-- | The upper bound of the bin that contains a percentile
+latencyPercentile :: Double -> Latency -> Word64
+latencyPercentile p (Latency n _ _ bs) = go 0 $ M.toAscList bs
+  where
+    target = ceiling (p * fromIntegral n) :: Int
+    go _ [] = 0
+    go acc ((b, k):rest)
+      | acc + k >= target = 2 ^ b
+      | otherwise         = go (acc + k) rest
+
+-- | The result of replaying a trace
+data Replayed = Replayed
+  { _rDelays     :: !(M.Map Keycode Delay) -- ^ Buffering delay per pressed key
+  , _rUnresolved :: !Int     -- ^ Presses that were never followed by output
+  , _rLatency    :: !Latency -- ^ Real time taken to react to each event
+  , _rWallTime   :: !Word64  -- ^ Real time taken by the whole replay, in ns
+  }
+makeClassy ''Replayed
+
+-- | The presses that have not been followed by any output yet, the delays of
+-- the ones that have, and how long KMonad took to react to each event.
+data Buffered = Buffered
+  { _pending :: ![(Word64, Keycode)]
+  , _delays  :: !(M.Map Keycode Delay)
+  , _latency :: !Latency
+  }
+makeLenses ''Buffered
+
+-- | Resolve all pending presses with an output at a time
+resolve :: Word64 -> Buffered -> Buffered
+resolve t b = b & pending .~ [] & delays .~ foldl' add (b^.delays) (b^.pending)
+  where
+    add m (p, c) = M.alter (Just . f (t - p) . fromMaybe (Delay 0 0 0)) c m
+    f d (Delay n s x) = Delay (n + 1) (s + d) (max x d)
+
+-- | Replay a trace through a config. Every output is passed to the callback, in
+-- order, followed by 'Nothing' once the trace has been replayed and all timers
+-- have expired.
+replayTrace :: HasLogFunc e
+  => CfgToken                -- ^ The config to replay through
+  -> FilePath                -- ^ The trace to replay
+  -> (Maybe Output -> IO ()) -- ^ What to do with the output
+  -> RIO e Replayed
+replayTrace cfg f out = do
+  vc   <- mkVirtualClock
+  inq  <- newTQueueIO
+  outq <- newTQueueIO
+  let clk = virtualClock vc
+  isrc <- mkKeySource (pure ()) (const $ pure ()) (const . blockOn clk $ readTQueue inq)
+  osnk <- mkKeySink   (pure ()) (const $ pure ()) $ \_ e -> do
+    t <- virtualTime vc
+    atomically $ writeTQueue outq (t, e)
+
+  let app = AppCfg
+        { _keySinkDev    = osnk
+        , _keySourceDev  = isrc
+        , _keymapCfg     = cfg^.km
+        , _firstLayer    = cfg^.fstL
+        , _fallThrough   = cfg^.flt
+        , _allowCmd      = False -- Never run commands from a replay
+        , _watchdogDelay = Nothing
+        , _eventMarkers  = False
+        , _perfCounters  = False
+        , _idleGC        = Nothing
+        , _idleWakeups   = False
+        , _heatmapFile   = Nothing
+        , _traceFile     = Nothing
+        , _tapInput      = Nothing
+        , _tapOutput     = Nothing
+        , _clock         = clk
+        }
+
+  -- Pass on everything emitted so far
+  let collect b = atomically (flushTQueue outq) >>= \case
+        [] -> pure b
+        os@((t, _):_) -> do
+          liftIO $ traverse_ (out . Just) os
+          pure $ resolve t b
+
+  -- Feed in 1 event, and time how long it takes KMonad to finish reacting
+  let step b (TraceEvent t e) = do
+        advanceTo vc loopThreads t
+        b' <- collect b
+        t0 <- liftIO getMonotonicTimeNSec
+        atomically $ writeTQueue inq e
+        settle vc loopThreads
+        t1 <- liftIO getMonotonicTimeNSec
+        pure $ b' & latency %~ addLatency (t1 - t0)
+                  & if isPress e then pending %~ ((t, e^.keycode):) else id
+
+  withAsync (startApp app) $ \a -> do
+    link a
+    settle vc loopThreads
+    t0 <- liftIO getMonotonicTimeNSec
+    b  <- foldTraceM f step (Buffered [] M.empty noLatency)
+    drainTimers vc loopThreads
+    b' <- collect b
+    t1 <- liftIO getMonotonicTimeNSec
+    liftIO $ out Nothing
+    pure $ Replayed (b'^.delays) (length $ b'^.pending) (b'^.latency) (t1 - t0)
+
+
+--------------------------------------------------------------------------------
+-- $compare
+
+-- | How 2 streams of output relate
+data Diff = Diff
+  { _common    :: !Int                  -- ^ Length of the identical prefix
+  , _firstDiff :: !(Maybe (Maybe Output, Maybe Output))
+  , _shiftSum  :: !Word64               -- ^ Time shift over the identical prefix
+  , _shiftMax  :: !Word64
+  , _presses   :: !(M.Map Keycode (Int, Int)) -- ^ Output presses of A and B
+  }
+makeLenses ''Diff
+
+-- | Add 1 output of A and B (either of which may have ended) to a 'Diff'
+addDiff :: Maybe Output -> Maybe Output -> Diff -> Diff
+addDiff a b d = d
+  & presses %~ tally _1 a . tally _2 b
+  & case (a, b, d^.firstDiff) of
+      (Just (ta, ea), Just (tb, eb), Nothing) | ea == eb ->
+        let s = if ta > tb then ta - tb else tb - ta
+        in (common +~ 1) . (shiftSum +~ s) . (shiftMax %~ max s)
+      (_, _, Nothing) -> firstDiff .~ Just (a, b)
+      _               -> id
+  where
+    tally l (Just (_, e)) | isPress e =
+      M.alter (Just . over l (+1) . fromMaybe (0, 0)) (e^.keycode)
+    tally _ _ = id
+
+-- | Read 2 streams of output in lockstep until both have ended
+diffOutputs :: MonadIO m => TBQueue (Maybe Output) -> TBQueue (Maybe Output) -> m Diff
+diffOutputs qa qb = go False False $ Diff 0 Nothing 0 0 M.empty
+  where
+    next q done = if done then pure Nothing else atomically $ readTBQueue q
+    go ea eb !d = do
+      a <- next qa ea
+      b <- next qb eb
+      if isNothing a && isNothing b then pure d
+        else go (isNothing a) (isNothing b) (addDiff a b d)
+
+-- | Replay a trace through 2 configs at the same time, and describe how their
+-- output and buffering delays differ.
+compareTraces :: HasLogFunc e
+  => CfgToken -- ^ Config A
+  -> CfgToken -- ^ Config B
+  -> FilePath -- ^ The trace to replay
+  -> RIO e Utf8Builder
+compareTraces a b f = do
+  qa <- newTBQueueIO 4096
+  qb <- newTBQueueIO 4096
+  (ra, rb, d) <- runConcurrently $ (,,)
+    <$> Concurrently (replayTrace a f $ atomically . writeTBQueue qa)
+    <*> Concurrently (replayTrace b f $ atomically . writeTBQueue qb)
+    <*> Concurrently (diffOutputs qa qb)
+  pure $ report ra rb d
+
+-- | Describe the result of a comparison
+report :: Replayed -> Replayed -> Diff -> Utf8Builder
+report ra rb d = mconcat
+  [ "output:\n"
+  , case d^.firstDiff of
+      Nothing -> "  identical, " <> display (d^.common) <> " events\n"
+      Just (a, b) -> mconcat
+        [ "  first difference at event ", display (d^.common + 1), ":\n"
+        , "    A: ", outLine a, "\n"
+        , "    B: ", outLine b, "\n"
+        ]
+  , if d^.common == 0 then "" else mconcat
+    [ "  timing shift over the first ", display (d^.common), " events: mean "
+    , ms (d^.shiftSum `div` fromIntegral (d^.common)), ", max ", ms (d^.shiftMax), "\n"
+    ]
+  , let ps = filter (uncurry (/=) . snd) . M.toList $ d^.presses in
+    if null ps then "" else mconcat $ "  presses that differ (A / B):\n" :
+      [ mconcat ["    ", display c, ": ", display n, " / ", display m, "\n"]
+      | (c, (n, m)) <- ps ]
+  , "\nbuffering delay per pressed key (A / B):\n"
+  , foldMap delayLine . M.keys $ M.union (() <$ da) (() <$ db)
+  , "\npresses never followed by output: ", display ua, " / ", display ub, "\n"
+  ]
+  where
+    (da, ua) = (ra^.rDelays, ra^.rUnresolved)
+    (db, ub) = (rb^.rDelays, rb^.rUnresolved)
+
+    ms :: Word64 -> Utf8Builder
+    ms us = fromString $ printf "%.1fms" (fromIntegral us / 1000 :: Double)
+
+    outLine Nothing       = "(ended)"
+    outLine (Just (t, e)) = display e <> " at " <> ms t
+
+    stats Nothing  = "-"
+    stats (Just x) = mconcat
+      [ "n=", display (x^.dCount)
+      , " mean=", ms (x^.dSum `div` fromIntegral (max 1 $ x^.dCount))
+      , " max=", ms (x^.dMax)
+      ]
+    delayLine c = mconcat
+      [ "  ", display c, "  ", stats (M.lookup c da), "  /  ", stats (M.lookup c db), "\n" ]
@@ -0,0 +1,164 @@
+{-|
+Module      : KMonad.Trace.Soak
+Description : Checking that long runs of the app-loop do not leak
+Copyright   : (c) David Janssen, 2019
+License     : MIT
+Maintainer  : janssen.dhj@gmail.com
+Stability   : experimental
+Portability : non-portable (counts threads through Linux's /proc)
+
+Feeds tens of millions of random events (see 'chaos') through the full app-loop
+of a config, with in-memory IO and a virtual clock (see "KMonad.Trace.Replay"),
+so that every tap-hold, multi-tap and layer button the config binds is pressed
+millions of times. The events come in chunks, each ending with every key
+released and every timer expired. After each chunk, we collect all garbage and
+take a sample of:
+
+  * the bytes live on the heap, which needs the RTS statistics (@+RTS -T@)
+  * the threads of the process, from @/proc/self/task@
+  * the hooks that are still waiting, which should be 0
+
+A soak fails when any of these ends higher than it was after the first chunk,
+allowing the live bytes some slack for the noise of the GC.
+
+-}
+module KMonad.Trace.Soak
+  ( Soak(..)
+  , HasSoak(..)
+  , defSoak
+  , soakConfigs
+  )
+where
+
+import KMonad.Prelude
+
+import GHC.Stats
+import RIO.Directory (listDirectory)
+import RIO.List (intercalate, lastMaybe)
+import System.Mem (performMajorGC)
+import Text.Printf (printf)
+
+import KMonad.App
+import KMonad.App.Clock
+import KMonad.Args.Types
+import KMonad.Keyboard.IO
+import KMonad.Trace
+import KMonad.Trace.Replay (loopThreads)
+import KMonad.Trace.Stress
+
+--------------------------------------------------------------------------------
+-- $soak
+
+-- | A description of a soak run
+data Soak = Soak
+  { _skEvents :: !Int    -- ^ How many random events to feed in
+  , _skChunk  :: !Int    -- ^ How many events to feed in between samples
+  , _skRate   :: !Int    -- ^ Mean input rate, in events per second of virtual time
+  , _skSeed   :: !Word64 -- ^ Seed of the first chunk
+  , _skSlack  :: !Double -- ^ How much the live bytes may grow, as a fraction
+  } deriving (Eq, Show)
+makeClassy ''Soak
+
+-- | 20M events in chunks of 1M at 20k events per second, allowing the live
+-- bytes to grow by 20%
+defSoak :: Soak
+defSoak = Soak 20000000 1000000 20000 1 0.2
+
+-- | The state of the process after a chunk of events
+data Sample = Sample
+  { _smEvents  :: !Int            -- ^ Events fed in so far
+  , _smLive    :: !(Maybe Word64) -- ^ Live bytes after a major GC
+  , _smThreads :: !(Maybe Int)    -- ^ Threads of the process
+  , _smHooks   :: !Int            -- ^ Hooks still waiting
+  }
+
+-- | Collect all garbage and take a 'Sample'
+sample :: MonadIO m => Int -> m Int -> m Sample
+sample n hooks = do
+  liftIO performMajorGC
+  live <- liftIO $ getRTSStatsEnabled >>= \case
+    False -> pure Nothing
+    True  -> Just . gcdetails_live_bytes . gc <$> getRTSStats
+  ts <- liftIO . handleIO (const $ pure Nothing) $
+    Just . length <$> listDirectory "/proc/self/task"
+  Sample n live ts <$> hooks
+
+-- | Feed all the chunks of a soak through a config, returning a 'Sample' after
+-- every chunk.
+soakConfig :: HasLogFunc e => Soak -> CfgToken -> RIO e [Sample]
+soakConfig s c = do
+  vc  <- mkVirtualClock
+  inq <- newTQueueIO
+  let clk = virtualClock vc
+  src <- mkKeySource (pure ()) (const $ pure ()) (const . blockOn clk $ readTQueue inq)
+  snk <- mkKeySink   (pure ()) (const $ pure ()) (\_ _ -> pure ())
+
+  let app = AppCfg
+        { _keySinkDev    = snk
+        , _keySourceDev  = src
+        , _keymapCfg     = c^.km
+        , _firstLayer    = c^.fstL
+        , _fallThrough   = c^.flt
+        , _allowCmd      = False -- Never run commands from a soak
+        , _watchdogDelay = Nothing
+        , _eventMarkers  = False
+        , _perfCounters  = False
+        , _idleGC        = Nothing
+        , _idleWakeups   = False
+        , _heatmapFile   = Nothing
+        , _traceFile     = Nothing
+        , _tapInput      = Nothing
+        , _tapOutput     = Nothing
+        , _clock         = clk
+        }
+
+  let chunks = take ((s^.skEvents + s^.skChunk - 1) `div` max 1 (s^.skChunk))
+                    [s^.skSeed ..]
+  let st     = Stress (s^.skChunk) (s^.skRate) 1 0 0
+  withApp app $ \hooks -> do
+    settle vc loopThreads
+    for (zip [1..] chunks) $ \(i, sd) -> do
+      t0 <- virtualTime vc
+      chaos (inputKeys c) st sd $ \(TraceEvent t e) -> do
+        advanceTo vc loopThreads (t0 + t)
+        atomically $ writeTQueue inq e
+      drainTimers vc loopThreads
+      sample (i * s^.skChunk) hooks
+
+-- | Describe everything that grew between the first and the last 'Sample'
+grown :: Double -> [Sample] -> [String]
+grown _ []       = []
+grown sl ss@(a:_) = let z = fromMaybe a $ lastMaybe ss in concat
+  [ [ "live bytes" | Just x <- [_smLive a], Just y <- [_smLive z]
+                   , fromIntegral y > fromIntegral x * (1 + sl) + slackBytes ]
+  , [ "threads"    | Just x <- [_smThreads a], Just y <- [_smThreads z], y > x ]
+  , [ "hooks"      | _smHooks z > _smHooks a ]
+  ]
+  where
+    -- Below this, differences in live bytes are noise
+    slackBytes = 1024 * 1024 :: Double
+
+-- | Soak every config, and describe the samples. Also returns whether nothing
+-- grew in any of them.
+soakConfigs :: HasLogFunc e
+  => Soak                     -- ^ The soak to run
+  -> [(FilePath, CfgToken)]   -- ^ The configs to soak, with their names
+  -> RIO e (Bool, Utf8Builder)
+soakConfigs s cs = do
+  rs <- for cs $ \(p, c) -> (p,) <$> soakConfig s c
+  let bad = map (grown (s^.skSlack) . snd) rs
+  pure (all null bad, header <> foldMap report (zip rs bad))
+  where
+    na = "-" :: String
+
+    header = fromString $
+      printf "%-30s %12s %12s %8s %8s\n"
+        ("config" :: String) ("events" :: String) ("live KiB" :: String)
+        ("threads" :: String) ("hooks" :: String)
+
+    line p (Sample n l t h) = fromString $
+      printf "%-30s %12d %12s %8s %8d\n" p n
+        (maybe na (show . (`div` 1024)) l) (maybe na show t) h
+
+    report ((p, ss), bad) = foldMap (line p) ss <> fromString
+      (printf "%-30s %s\n\n" p $ if null bad then "ok" else "FAIL: grew: " <> intercalate ", " bad)
@@ -0,0 +1,176 @@
+{-|
+Module      : KMonad.Trace.Stress
+Description : Randomized stress runs of the full app-loop
+Copyright   : (c) David Janssen, 2019
+License     : MIT
+Maintainer  : janssen.dhj@gmail.com
+Stability   : experimental
+Portability : portable
+
+Drives the full app-loop of a config (dispatch, hooks, sluice and keymap) with
+streams of random events on every key the config binds, at a high rate and with
+the occasional long pause, so that every kind of button gets pressed, held,
+rolled over and timed out in every order. The streams are replayed with
+in-memory IO and a virtual clock (see "KMonad.Trace.Replay"), so a failure can
+be reproduced exactly from its seed.
+
+After every run, 2 invariants are checked:
+
+  1. Once every input key has been released and every timer has expired, no
+     output key is left pressed.
+  2. KMonad processes the input faster than a given floor, in events per second
+     of real time.
+
+-}
+module KMonad.Trace.Stress
+  ( -- * Stress runs
+    Stress(..)
+  , HasStress(..)
+  , defStress
+
+    -- * Running
+  , chaos
+  , inputKeys
+  , stressConfigs
+  )
+where
+
+import KMonad.Prelude
+
+import RIO.Text (unpack)
+import Text.Printf (printf)
+
+import KMonad.Args.Types
+import KMonad.Keyboard
+import KMonad.Trace
+import KMonad.Trace.Generate (splitmix)
+import KMonad.Trace.Replay
+
+import qualified Data.LayerStack as Ls
+import qualified RIO.ByteString  as B
+import qualified RIO.HashMap     as HM
+import qualified RIO.Set         as S
+
+--------------------------------------------------------------------------------
+-- $stress
+
+-- | A description of a stress run
+data Stress = Stress
+  { _sEvents :: !Int    -- ^ How many random events to feed in per round
+  , _sRate   :: !Int    -- ^ Mean input rate, in events per second of virtual time
+  , _sRounds :: !Int    -- ^ How many rounds to run, each with its own seed
+  , _sSeed   :: !Word64 -- ^ Seed of the first round
+  , _sFloor  :: !Double -- ^ Lowest acceptable throughput, in events per second
+  } deriving (Eq, Show)
+makeClassy ''Stress
+
+-- | 100k events per round at 20k events per second, over 3 rounds
+defStress :: Stress
+defStress = Stress 100000 20000 3 1 10000
+
+-- | The most input keys held at the same time
+maxHeld :: Int
+maxHeld = 6
+
+-- | Pass a random stream of events on some keys to a callback, in order of
+-- time. Keys are pressed and released in random order, never more than
+-- 'maxHeld' at once, and about 1 in 50 gaps is long enough for timeouts to
+-- expire. The stream ends by releasing everything that is still held.
+chaos :: Monad m
+  => [Keycode]              -- ^ The keys to press
+  -> Stress                 -- ^ How many events, and how fast
+  -> Word64                 -- ^ The seed
+  -> (TraceEvent -> m ())   -- ^ What to do with every event
+  -> m ()
+chaos [] _ _ _ = pure ()
+chaos ks s r0 out = go (s^.sEvents) r0 0 S.empty
+  where
+    -- The average time between events in microseconds
+    mean = 1000000 / fromIntegral (max 1 $ s^.sRate) :: Double
+    pick u xs = xs ^? ix (floor $ u * fromIntegral (length xs))
+
+    go n r t held
+      | n <= 0 = for_ (zip [1..] $ S.toList held) $ \(i, k) ->
+          out . TraceEvent (t + i * ceiling mean) $ mkRelease k
+      | otherwise = do
+          let (u1, r1) = splitmix r
+              (u2, r2) = splitmix r1
+              (u3, r3) = splitmix r2
+              (u4, r4) = splitmix r3
+              gap | u1 < 0.02 = round $ u2 * 1000000
+                  | otherwise = round $ u2 * 2 * mean
+              t'  = t + gap
+              k   = fromMaybe KeyA $ pick u4 ks
+              rel c = out (TraceEvent t' $ mkRelease c) >> go (n - 1) r4 t' (S.delete c held)
+          if | S.null held || (S.size held < maxHeld && u3 < 0.55) ->
+                 if S.member k held then rel k else do
+                   out . TraceEvent t' $ mkPress k
+                   go (n - 1) r4 t' (S.insert k held)
+             | otherwise -> rel . fromMaybe k . pick u4 $ S.toList held
+
+
+--------------------------------------------------------------------------------
+-- $run
+
+-- | The outcome of 1 round on 1 config
+data Round = Round
+  { _rConfig :: FilePath
+  , _rSeed   :: Word64
+  , _rResult :: Either Text (Int, Double, [Keycode]) -- ^ Events, events/s, stuck keys
+  }
+
+-- | Whether a 'Round' upholds every invariant
+passed :: Double -> Round -> Bool
+passed fl (Round _ _ r) = case r of
+  Right (_, x, []) -> x >= fl
+  _                -> False
+
+-- | Every key that is bound in any layer of a config
+inputKeys :: CfgToken -> [Keycode]
+inputKeys c = S.toList . S.fromList . map snd . HM.keys $ c^.km . Ls.items
+
+-- | Run 1 round of 'chaos' through a config, tracking which output keys are
+-- held.
+runRound :: HasLogFunc e => Stress -> Word64 -> (FilePath, CfgToken) -> RIO e Round
+runRound s sd (p, c) = withSystemTempFile "kmonad-stress.trace" $ \f h -> do
+  hSetBuffering h $ BlockBuffering Nothing
+  liftIO $ B.hPut h traceHeader
+  chaos (inputKeys c) s sd $ writeEvent h
+  hClose h
+  held <- newIORef S.empty
+  let track = \case
+        Just (_, e) | isPress e -> modifyIORef' held . S.insert $ e^.keycode
+                    | otherwise -> modifyIORef' held . S.delete $ e^.keycode
+        Nothing -> pure ()
+  Round p sd <$> (tryAny (replayTrace c f track) >>= \case
+    Left err -> pure . Left $ tshow err
+    Right r  -> do
+      stuck <- readIORef held
+      let (n, _, _) = latencyStats $ r^.rLatency
+          secs      = fromIntegral (r^.rWallTime) / 1e9 :: Double
+      pure $ Right (n, fromIntegral n / max 1e-9 secs, S.toList stuck))
+
+-- | Run every config through a number of rounds of 'chaos', and describe the
+-- results. Also returns whether every round upheld every invariant.
+stressConfigs :: HasLogFunc e
+  => Stress                   -- ^ The stress run to do
+  -> [(FilePath, CfgToken)]   -- ^ The configs to stress, with their names
+  -> RIO e (Bool, Utf8Builder)
+stressConfigs s cs = do
+  rs <- for cs $ \pc -> for (take (s^.sRounds) [s^.sSeed ..]) $ \sd ->
+    runRound s sd pc
+  let rs' = concat rs
+  pure (all (passed $ s^.sFloor) rs', header <> foldMap line rs')
+  where
+    header = fromString $
+      printf "%-30s %10s %10s %12s  %s\n"
+        ("config" :: String) ("seed" :: String) ("events" :: String)
+        ("events/s" :: String) ("result" :: String)
+
+    line rd@(Round p sd r) = fromString $ case r of
+      Left err -> printf "%-30s %10d %10s %12s  FAIL: %s\n" p sd ("-" :: String)
+                    ("-" :: String) (unpack err)
+      Right (n, x, stuck) -> printf "%-30s %10d %10d %12.0f  %s\n" p sd n x $
+        if | passed (s^.sFloor) rd -> "ok" :: String
+           | not (null stuck)      -> "FAIL: left pressed: " <> unwords (map show stuck)
+           | otherwise             -> printf "FAIL: below %.0f events/s" (s^.sFloor)
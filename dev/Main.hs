@@ -0,0 +1,21 @@
+{-|
+Module      : Main
+Description : The entry-point to the KMonad development harnesses
+Copyright   : (c) David Janssen, 2019
+License     : MIT
+
+Maintainer  : janssen.dhj@gmail.com
+Stability   : experimental
+Portability : non-portable (MPTC with FD, FFI to Linux-only c-code)
+
+-}
+module Main
+  ( -- * The entry-point to kmonad-dev
+    main
+  )
+where
+
+import KMonad.Dev (run)
+
+main :: IO ()
+main = run
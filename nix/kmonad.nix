@@ -1,4 +1,4 @@
-{ mkDerivation, base, cereal, lens, megaparsec, mtl
+{ mkDerivation, base, lens, megaparsec, mtl
 , optparse-applicative, resourcet, rio, stdenv, time, unix
 , unliftio
 }:
@@ -9,10 +9,12 @@ mkDerivation {
   isLibrary = true;
   isExecutable = true;
   libraryHaskellDepends = [
-    base cereal lens megaparsec mtl optparse-applicative resourcet rio
+    base lens megaparsec mtl optparse-applicative resourcet rio
     time unix unliftio
   ];
-  executableHaskellDepends = [ base ];
+  executableHaskellDepends = [
+    base lens optparse-applicative rio unliftio
+  ];
   doHaddock = false;
   description = "Advanced keyboard remapping utility";
   license = stdenv.lib.licenses.mit;
@@ -13,6 +13,11 @@ provides functionality for keeping track of a `stack` of these mappings. Lookup
 in a 'LayerStack' happens by checking the front-most mapping on the stack, and
 if that fails, descending deeper.
 
+Internally, every layer is interned to a small integer id. The layers on the
+stack are stored both as a bitset over those ids, so that checking whether a
+layer is active is O(1), and as a map from push-order to layer, so that pushing
+and popping are O(log n) instead of a linear walk over a list.
+
 A 'LayerStack' has 3 type parameters, in the documentation we will refer to
 those as:
   - l: The layer key, which is the identifier for the different layers
@@ -39,6 +44,7 @@ module Data.LayerStack
     -- $ops
   , atKey
   , inLayer
+  , isActive
   , pushLayer
   , popLayer
 
@@ -52,10 +58,11 @@ where
 
 import KMonad.Prelude
 
-import RIO.List (delete)
+import Data.Bits (setBit, clearBit, testBit)
 
 import qualified RIO.HashMap as M
 import qualified RIO.HashSet as S
+import qualified RIO.Map     as O
 
 --------------------------------------------------------------------------------
 -- $err
@@ -90,12 +97,20 @@ mkLayer = Layer . M.fromList . toList
 -- | A 'LayerStack' is a named collection of maps and a sequence of maps to use
 -- for lookup.
 data LayerStack l k a = LayerStack
-  { _stack :: ![l]                  -- ^ The current stack of layers
-  , _maps  :: !(S.HashSet l)        -- ^ A set of all 'Layer' names
-  , _items :: !(M.HashMap (l, k) a) -- ^ The map of all the bindings
+  { _layerIds :: !(M.HashMap l Int)     -- ^ The interned id of every 'Layer'
+  , _active   :: !Integer               -- ^ Bitset of the ids on the stack
+  , _order    :: !(O.Map Int l)         -- ^ The stack, front-most first
+  , _position :: !(O.Map Int Int)       -- ^ Where each id is in '_order'
+  , _pushes   :: !Int                   -- ^ Number of pushes so far
+  , _maps     :: !(S.HashSet l)         -- ^ A set of all 'Layer' names
+  , _items    :: !(M.HashMap (l, k) a)  -- ^ The map of all the bindings
   } deriving (Show, Eq, Functor)
 makeLenses ''LayerStack
 
+-- | The current stack of layers, front-most first
+stack :: Getter (LayerStack l k a) [l]
+stack = order . to O.elems
+
 
 -- | Create a new 'LayerStack' from a foldable of foldables.
 mkLayerStack :: (Foldable t1, Foldable t2, CanKey k, CanKey l)
@@ -108,7 +123,9 @@ mkLayerStack nestMaps = let
   its = M.fromList $ hms ^@.. ifolded <.> (to unLayer . ifolded)
 --   -- Create a HashSet of keys from `its`
   kys = S.fromList . M.keys $ hms
-  in LayerStack [] kys its
+--   -- Intern every layer name
+  ids = M.fromList $ zip (M.keys hms) [0..]
+  in LayerStack ids 0 O.empty O.empty 0 kys its
 
 --------------------------------------------------------------------------------
 -- $ops
@@ -126,6 +143,11 @@ atKey c = folding $ \m -> m ^.. stack . folded . to (getK m) . folded
 inLayer :: (CanKey l, CanKey k) => l -> k -> Fold (LayerStack l k a) a
 inLayer l c = folding $ \m -> m ^? items . ix (l, c)
 
+-- | Check whether a layer is currently on the stack
+isActive :: CanKey l => l -> LayerStack l k a -> Bool
+isActive n keymap = maybe False (testBit $ keymap^.active)
+  $ M.lookup n (keymap^.layerIds)
+
 -- | Add a layer to the front of the stack and return the new 'LayerStack'.
 --
 -- If the 'Layer' does not exist, return a 'LayerStackError'. If the 'Layer' is
@@ -135,12 +157,16 @@ pushLayer :: (CanKey l, CanKey k)
   => l
   -> LayerStack l k a
   -> Either (LayerStackError l) (LayerStack l k a)
-pushLayer n keymap = if n `elem` keymap^.maps
-  then Right $ keymap & stack %~ (addFront n)
-  else Left  $ LayerDoesNotExist n
-  where addFront a as = case break (a ==) as of
-          (frnt, a':rest) -> a':(frnt <> rest)
-          (frnt, [])      -> a:frnt
+pushLayer n keymap = case M.lookup n (keymap^.layerIds) of
+  Nothing -> Left $ LayerDoesNotExist n
+  Just i  -> let
+    -- Later pushes get lower positions, so the front is the lowest position
+    p = negate $ keymap^.pushes
+    in Right $ removeId i keymap
+         & order    %~ O.insert p n
+         & position %~ O.insert i p
+         & active   %~ flip setBit i
+         & pushes   +~ 1
 
 -- | Remove a layer from the stack. If the layer index does not exist on the
 -- stack, return a 'LayerNotOnStack', if the layer index does not exist at all
@@ -149,7 +175,17 @@ popLayer :: (CanKey l, CanKey k)
   => l
   -> LayerStack l k a
   -> Either (LayerStackError l) (LayerStack l k a)
-popLayer n keymap = if
-  | n `elem` keymap^.stack -> Right $ keymap & stack %~ delete n
-  | n `elem` keymap^.maps  -> Left  $ LayerNotOnStack   n
-  | otherwise              -> Left  $ LayerDoesNotExist n
+popLayer n keymap = case M.lookup n (keymap^.layerIds) of
+  Nothing -> Left $ LayerDoesNotExist n
+  Just i
+    | testBit (keymap^.active) i -> Right $ removeId i keymap
+    | otherwise                  -> Left  $ LayerNotOnStack n
+
+-- | Remove the layer with an id from the stack, if it is on it
+removeId :: Int -> LayerStack l k a -> LayerStack l k a
+removeId i keymap = case O.lookup i (keymap^.position) of
+  Nothing -> keymap
+  Just p  -> keymap
+    & order    %~ O.delete p
+    & position %~ O.delete i
+    & active   %~ flip clearBit i
@@ -61,6 +61,7 @@ where
 import KMonad.Prelude hiding (timeout)
 
 import KMonad.Keyboard
+import KMonad.Keyboard.Pointer
 import KMonad.Util
 
 --------------------------------------------------------------------------------
@@ -147,6 +148,8 @@ class Monad m => MonadKIO m where
   inject     :: KeyEvent -> m ()
   -- | Run a shell-command
   shellCmd   :: Text -> m ()
+  -- | Start or stop moving the pointer
+  pointer    :: Motion -> m ()
 
 -- | 'MonadKIO' contains the additional bindings that get added when we are
 -- currently processing a button.
@@ -13,6 +13,7 @@ module KMonad.App
   ( AppCfg(..)
   , HasAppCfg(..)
   , startApp
+  , withApp
   )
 where
 
@@ -22,16 +23,24 @@ import UnliftIO.Process (spawnCommand)
 import RIO.Text (unpack)
 
 import KMonad.Action
+import KMonad.App.Clock
 import KMonad.Button
 import KMonad.Keyboard
 import KMonad.Keyboard.IO
+import KMonad.Trace (mkRecorder, record)
 import KMonad.Util
 import KMonad.App.BEnv
 
-import qualified KMonad.App.Dispatch as Dp
-import qualified KMonad.App.Hooks    as Hs
-import qualified KMonad.App.Sluice   as Sl
-import qualified KMonad.App.Keymap   as Km
+import qualified Data.LayerStack         as Ls
+import qualified KMonad.App.Dispatch     as Dp
+import qualified KMonad.App.Heatmap      as Hm
+import qualified KMonad.App.Hooks        as Hs
+import qualified KMonad.App.Idle         as Id
+import qualified KMonad.App.Sluice       as Sl
+import qualified KMonad.App.Tap          as Tp
+import qualified KMonad.App.Keymap       as Km
+import qualified KMonad.App.PerfCounters as Pc
+import qualified KMonad.App.Watchdog     as Wd
 
 --------------------------------------------------------------------------------
 -- $appcfg
@@ -52,12 +61,22 @@ import qualified KMonad.App.Keymap   as Km
 -- | Record of all the configuration options required to run KMonad's core App
 -- loop.
 data AppCfg = AppCfg
-  { _keySinkDev   :: Acquire KeySink   -- ^ How to open a 'KeySink'
-  , _keySourceDev :: Acquire KeySource -- ^ How to open a 'KeySource'
-  , _keymapCfg    :: LMap Button       -- ^ The map defining the 'Button' layout
-  , _firstLayer   :: LayerTag          -- ^ Active layer when KMonad starts
-  , _fallThrough  :: Bool              -- ^ Whether uncaught events should be emitted or not
-  , _allowCmd     :: Bool              -- ^ Whether shell-commands are allowed
+  { _keySinkDev    :: Acquire KeySink    -- ^ How to open a 'KeySink'
+  , _keySourceDev  :: Acquire KeySource  -- ^ How to open a 'KeySource'
+  , _keymapCfg     :: LMap Button        -- ^ The map defining the 'Button' layout
+  , _firstLayer    :: LayerTag           -- ^ Active layer when KMonad starts
+  , _fallThrough   :: Bool               -- ^ Whether uncaught events should be emitted or not
+  , _allowCmd      :: Bool               -- ^ Whether shell-commands are allowed
+  , _watchdogDelay :: Maybe Milliseconds -- ^ Report events slower than this
+  , _eventMarkers  :: Bool               -- ^ Whether to mark stages in the eventlog
+  , _perfCounters  :: Bool               -- ^ Whether to count cycles per step
+  , _idleGC        :: Maybe Milliseconds -- ^ Idle time after which to GC
+  , _idleWakeups   :: Bool               -- ^ Whether to count wakeups while idle
+  , _heatmapFile   :: Maybe FilePath     -- ^ Where to write key usage counts
+  , _traceFile     :: Maybe FilePath     -- ^ Where to record the input trace
+  , _tapInput      :: Maybe FilePath     -- ^ Where to mirror input events
+  , _tapOutput     :: Maybe FilePath     -- ^ Where to mirror output events
+  , _clock         :: Clock              -- ^ How to tell time and wait
   }
 makeClassy ''AppCfg
 
@@ -81,6 +100,9 @@ data AppEnv = AppEnv
   , _keymap     :: Km.Keymap
   , _outHooks   :: Hs.Hooks
   , _outVar     :: TMVar KeyEvent
+  , _watchdog   :: Wd.Watchdog
+  , _counters   :: Pc.PerfCounters
+  , _heatmap    :: Hm.Heatmap
   }
 makeClassy ''AppEnv
 
@@ -106,22 +128,65 @@ initAppEnv cfg = do
   snk <- using $ cfg^.keySinkDev
   src <- using $ cfg^.keySourceDev
 
-  -- Initialize the pull-chain components
-  dsp <- Dp.mkDispatch $ awaitKey src
-  ihk <- Hs.mkHooks    $ Dp.pull  dsp
-  slc <- Sl.mkSluice   $ Hs.pull  ihk
+  -- Initialize the latency watchdog
+  wdg <- Wd.mkWatchdog (cfg^.watchdogDelay)
+
+  -- Open the hardware counters (in this thread, which will run the loop)
+  pcs <- Pc.mkPerfCounters (cfg^.perfCounters)
 
   -- Initialize the button environments in the keymap
   phl <- Km.mkKeymap (cfg^.firstLayer) (cfg^.keymapCfg)
 
+  -- Initialize the key usage counters, which read the layers from the keymap
+  hmp <- Hm.mkHeatmap (cfg^.heatmapFile) (toList $ cfg^.keymapCfg.Ls.maps) phl
+
+  -- Initialize the idle-state tracker
+  idl <- Id.mkIdle (cfg^.idleGC) (cfg^.idleWakeups)
+
+  -- Open the input trace
+  trc <- mkRecorder (cfg^.traceFile)
+
+  -- Open the taps that mirror input and output events
+  itp <- Tp.mkTap "input"  (cfg^.tapInput)
+  otp <- Tp.mkTap "output" (cfg^.tapOutput)
+
+  -- Initialize the pull-chain components
+  let mrk = traceMark $ cfg^.eventMarkers
+  let clk = cfg^.clock
+  dsp <- Dp.mkDispatch clk $ do
+    Id.waiting idl
+    e <- awaitKey src
+    Wd.received wdg
+    record trc e
+    Tp.tap itp e
+    Id.arrived idl e
+    mrk "awaitKey"
+    pure e
+  ihk <- Hs.mkHooks clk $ Dp.pull  dsp <* mrk "dispatch"
+  slc <- Sl.mkSluice    $ Hs.pull  ihk <* mrk "hooks"
+
   -- Initialize output components
   otv <- lift . atomically $ newEmptyTMVar
-  ohk <- Hs.mkHooks . atomically . takeTMVar $ otv
+  ohk <- Hs.mkHooks clk . atomically . takeTMVar $ otv
+
+  -- We are only idle when no hooks are waiting
+  lift . Id.watchPending idl $ (+) <$> Hs.countSTM ihk <*> Hs.countSTM ohk
 
   -- Setup thread to read from outHooks and emit to keysink
+  --
+  -- NOTE: Batching sinks only write on a flush, so the write is only marked and
+  -- timed once the flush is done. The loop rarely has a next event ready the
+  -- moment we take one, so in practice most flushes carry a single event.
   launch_ "emitter_proc" $ do
-    e <- atomically . takeTMVar $ otv
+    e <- blockOn clk . takeTMVar $ otv
+    t <- Wd.writing wdg
+    Tp.tap otp e
     emitKey snk e
+    -- Let batching sinks post once nothing else is waiting to be emitted
+    whenM (atomically $ isEmptyTMVar otv) $ do
+      flushKeys snk
+      mrk "sink write"
+      Wd.written wdg t
   -- emit e = view keySink >>= flip emitKey e
   pure $ AppEnv
     { _keAppCfg  = cfg
@@ -136,6 +201,9 @@ initAppEnv cfg = do
     , _keymap    = phl
     , _outHooks  = ohk
     , _outVar    = otv
+    , _watchdog  = wdg
+    , _counters  = pcs
+    , _heatmap   = hmp
     }
 
 
@@ -144,16 +212,38 @@ initAppEnv cfg = do
 --
 -- The central app-loop of KMonad.
 
+-- | Lookup the 'BEnv' bound to a 'Keycode', mark the lookup as done, and count
+-- the press in the layer it was found in.
+lookupKey :: (HasAppEnv e, HasAppCfg e) => Keycode -> RIO e (Maybe BEnv)
+lookupKey c = do
+  b <- view keymap >>= flip Km.lookupKey c
+  view watchdog >>= flip Wd.mark Wd.LookedUp
+  view heatmap  >>= \h -> Hm.pressed h (fst <$> b) c
+  when (isJust b) $ classify Pc.PlainKey
+  stage "keymap lookup"
+  pure $ snd <$> b
+
+-- | Note that something of a particular 'Pc.Kind' happened during this step
+classify :: HasAppEnv e => Pc.Kind -> RIO e ()
+classify k = do
+  view counters >>= flip Pc.classify k
+  view heatmap  >>= flip Hm.resolved k
+
+-- | Mark a stage of the app-loop in the eventlog, if enabled
+stage :: HasAppCfg e => String -> RIO e ()
+stage s = view eventMarkers >>= flip traceMark s
+
 -- | Trigger the button-action press currently registered to 'Keycode'
 pressKey :: (HasAppEnv e, HasLogFunc e, HasAppCfg e) => Keycode -> RIO e ()
 pressKey c =
-  view keymap >>= flip Km.lookupKey c >>= \case
+  lookupKey c >>= \case
 
     -- If the keycode does not occur in our keymap
     Nothing -> do
       ft <- view fallThrough
       if ft
         then do
+          classify Pc.Fallthrough
           emit $ mkPress c
           await (isReleaseOf c) $ \_ -> do
             emit $ mkRelease c
@@ -177,28 +267,67 @@ pressKey c =
 -- We forever:
 -- 1. Pull from the pull-chain until an unhandled event reaches us.
 -- 2. If that event is a 'Press' we use our keymap to trigger an action.
+-- 3. Let the 'Wd.Watchdog' check how long that took.
 loop :: RIO AppEnv ()
-loop = forever $ view sluice >>= Sl.pull >>= \case
-  e | e^.switch == Press -> pressKey $ e^.keycode
-  _                      -> pure ()
+loop = forever $ do
+  wd <- view watchdog
+  pc <- view counters
+  Pc.begin pc
+  e  <- view sluice >>= Sl.pull
+  stage "sluice"
+  Wd.mark wd Wd.Pulled
+  when (e^.switch == Press) $ pressKey (e^.keycode)
+  Wd.check wd stateReport
+  Pc.end pc
+
+-- | Describe the state of the pull-chain for the 'Wd.Watchdog' report
+stateReport :: RIO AppEnv Utf8Builder
+stateReport = do
+  ih <- view inHooks  >>= Hs.count
+  oh <- view outHooks >>= Hs.count
+  sd <- view sluice   >>= Sl.depth
+  pure $ "input hooks: "    <> display ih
+      <> ", output hooks: " <> display oh
+      <> ", sluice depth: " <> display sd
 
 -- | Run KMonad using the provided configuration
 startApp :: HasLogFunc e => AppCfg -> RIO e ()
 startApp c = runContT (initAppEnv c) (flip runRIO loop)
 
+-- | Run KMonad in the background for as long as an action runs. The action is
+-- given a way to count the hooks that are still waiting, which should drop back
+-- to 0 whenever no keys are held and no timers are pending.
+--
+-- NOTE: The loop does not run in the calling thread, so the hardware counters
+-- (which count the thread that opened them) do not work here.
+withApp :: HasLogFunc e => AppCfg -> (RIO e Int -> RIO e a) -> RIO e a
+withApp c f = runContT (initAppEnv c) $ \env ->
+  withAsync (runRIO env loop) $ \a -> do
+    link a
+    f . runRIO env $ (+) <$> (view inHooks >>= Hs.count)
+                         <*> (view outHooks >>= Hs.count)
+
 instance (HasAppEnv e, HasAppCfg e, HasLogFunc e) => MonadKIO (RIO e) where
   -- Emitting with the keysink
-  emit e = view outVar >>= atomically . flip putTMVar e
+  emit e = do
+    view outVar >>= atomically . flip putTMVar e
+    view watchdog >>= flip Wd.mark Wd.Queued
+    stage "emit"
   -- emit e = view keySink >>= flip emitKey e
 
-  -- Pausing is a simple IO action
-  pause = threadDelay . (*1000) . fromIntegral
+  -- Pausing waits on the clock
+  pause d = view clock >>= flip sleep d
 
   -- Holding and rerunning through the sluice and dispatch
   hold b = do
     sl <- view sluice
     di <- view dispatch
-    if b then Sl.block sl else Sl.unblock sl >>= Dp.rerun di
+    wd <- view watchdog
+    if b then Sl.block sl else do
+      classify Pc.Resolution
+      es <- Sl.unblock sl
+      unless (null es) $ Wd.rerunning wd
+      Dp.rerun di es
 
   -- Hooking is performed with the hooks component
   register l h = do
@@ -208,12 +337,15 @@ instance (HasAppEnv e, HasAppCfg e, HasLogFunc e) => MonadKIO (RIO e) where
     Hs.register hs h
 
   -- Layer-ops are sent to the 'Keymap'
-  layerOp o = view keymap >>= \hl -> Km.layerOp hl o
+  layerOp o = do
+    classify Pc.LayerChange
+    view keymap >>= \hl -> Km.layerOp hl o
 
   -- Injecting by adding to Dispatch's rerun buffer
   inject e = do
     di <- view dispatch
     logDebug $ "Injecting event: " <> display e
+    view watchdog >>= Wd.rerunning
     Dp.rerun di [e]
 
   -- Shell-command through spawnCommand
@@ -225,6 +357,9 @@ instance (HasAppEnv e, HasAppCfg e, HasLogFunc e) => MonadKIO (RIO e) where
     else
       logInfo $ "Received but not running: " <> display t
 
+  -- Pointer motion is performed by the keysink
+  pointer m = view keySink >>= flip moveKeys m
+
 --------------------------------------------------------------------------------
 -- $kenv
 --
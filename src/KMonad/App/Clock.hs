@@ -0,0 +1,192 @@
+{-|
+Module      : KMonad.App.Clock
+Description : The source of time for the app-loop
+Copyright   : (c) David Janssen, 2019
+License     : MIT
+Maintainer  : janssen.dhj@gmail.com
+Stability   : experimental
+Portability : portable
+
+Everything in the app-loop that depends on time (timestamping hooks, timing them
+out, and pausing in macros) goes through a 'Clock', as does every place where a
+thread of the pull-chain blocks waiting for work.
+
+Normally this is the 'realClock', which simply uses the system clock, threads
+and 'atomically'. A 'VirtualClock' instead only moves when it is told to. Since
+it also knows where every thread of the pull-chain is blocked, it can tell when
+KMonad has finished reacting to everything that happened so far ('settle'), so
+that a recorded trace can be replayed exactly and as fast as possible, without
+depending on scheduling or on the speed of the machine.
+
+-}
+module KMonad.App.Clock
+  ( -- * Clocks
+    Clock
+  , realClock
+  , getTime
+  , schedule
+  , sleep
+  , blockOn
+  , spawn
+
+    -- * Virtual time
+  , VirtualClock
+  , mkVirtualClock
+  , virtualClock
+  , settle
+  , advanceTo
+  , drainTimers
+  , virtualTime
+  )
+where
+
+import KMonad.Prelude
+
+import Data.Time.Clock.System
+
+import KMonad.Util
+
+import qualified RIO.Map as M
+
+--------------------------------------------------------------------------------
+-- $clock
+
+-- | How the app-loop tells time and waits
+data Clock = Clock
+  { _getTime  :: IO SystemTime
+  , _schedule :: Milliseconds -> STM () -> IO ()
+  , _blockOn  :: forall a. STM a -> IO a
+  , _spawn    :: forall a. IO a -> IO (Async a)
+  }
+
+-- | The 'Clock' that follows the system clock
+realClock :: Clock
+realClock = Clock
+  { _getTime  = getSystemTime
+  , _schedule = \d a -> void . async $ do
+      threadDelay $ 1000 * fromIntegral d
+      atomically a
+  , _blockOn  = atomically
+  , _spawn    = async
+  }
+
+-- | Return the current time
+getTime :: MonadIO m => Clock -> m SystemTime
+getTime c = liftIO $ _getTime c
+
+-- | Run an 'STM' action after a delay, without waiting for it. The action
+-- should never block, since under a 'VirtualClock' it runs as part of advancing
+-- time.
+schedule :: MonadIO m => Clock -> Milliseconds -> STM () -> m ()
+schedule c d = liftIO . _schedule c d
+
+-- | Wait for a period of time
+sleep :: MonadIO m => Clock -> Milliseconds -> m ()
+sleep c d = liftIO $ do
+  v <- newEmptyTMVarIO
+  _schedule c d $ putTMVar v ()
+  _blockOn c $ takeTMVar v
+
+-- | Run an 'STM' transaction that waits for work to arrive. This is
+-- 'atomically', except that a 'VirtualClock' keeps track of the wait.
+blockOn :: MonadIO m => Clock -> STM a -> m a
+blockOn c a = liftIO $ _blockOn c a
+
+-- | Start a thread that is part of the pull-chain. This is 'async', except that
+-- a 'VirtualClock' keeps track of the threads that are running.
+spawn :: MonadIO m => Clock -> IO a -> m (Async a)
+spawn c a = liftIO $ _spawn c a
+
+
+--------------------------------------------------------------------------------
+-- $virtual
+
+-- | A clock that only moves when told to
+data VirtualClock = VirtualClock
+  { _now     :: TVar Word64                        -- ^ Microseconds since start
+  , _timers  :: TVar (M.Map (Word64, Int) (STM ())) -- ^ Scheduled actions
+  , _waiting :: TVar (M.Map Int (STM ()))          -- ^ What each blocked thread waits on
+  , _spawned :: TVar Int                           -- ^ How many spawned threads are alive
+  , _nextId  :: TVar Int                           -- ^ Used to keep keys unique
+  }
+makeLenses ''VirtualClock
+
+-- | Create a 'VirtualClock' at time 0
+mkVirtualClock :: MonadIO m => m VirtualClock
+mkVirtualClock = atomically $
+  VirtualClock <$> newTVar 0 <*> newTVar M.empty <*> newTVar M.empty
+               <*> newTVar 0 <*> newTVar 0
+
+-- | The 'Clock' interface to a 'VirtualClock'
+virtualClock :: VirtualClock -> Clock
+virtualClock v = Clock
+  { _getTime  = toSystemTime <$> readTVarIO (v^.now)
+  , _schedule = \d a -> atomically $ do
+      t <- (+ 1000 * fromIntegral d) <$> readTVar (v^.now)
+      i <- fresh v
+      modifyTVar' (v^.timers) $ M.insert (t, i) a
+  , _blockOn  = \a -> do
+      i <- atomically $ do
+        i <- fresh v
+        modifyTVar' (v^.waiting) $ M.insert i (void a)
+        pure i
+      atomically $ a <* modifyTVar' (v^.waiting) (M.delete i)
+  , _spawn    = \a -> do
+      -- Count the thread before it exists, so it can never be missed
+      atomically $ modifyTVar' (v^.spawned) (+1)
+      async $ a `finally` atomically (modifyTVar' (v^.spawned) (subtract 1))
+  }
+  where
+    toSystemTime us = MkSystemTime (fromIntegral $ us `div` 1000000)
+                                    (fromIntegral $ 1000 * (us `mod` 1000000))
+
+-- | Return a new unique key
+fresh :: VirtualClock -> STM Int
+fresh v = do
+  i <- readTVar (v^.nextId)
+  writeTVar (v^.nextId) $ i + 1
+  pure i
+
+-- | Return the current time in microseconds
+virtualTime :: MonadIO m => VirtualClock -> m Word64
+virtualTime v = readTVarIO (v^.now)
+
+-- | Wait until every thread of the pull-chain is blocked in 'blockOn', and none
+-- of them could make any progress. At that point nothing will happen until time
+-- moves or new input arrives. The threads are the @n@ long-lived ones that were
+-- not started with 'spawn', and all the ones that were.
+--
+-- NOTE: A thread that has registered its wait but has not blocked yet only
+-- counts as blocked if its transaction would actually retry, so this never
+-- mistakes a thread that is about to run for an idle one.
+settle :: MonadIO m => VirtualClock -> Int -> m ()
+settle v n = atomically $ do
+  ws <- readTVar (v^.waiting)
+  ts <- readTVar (v^.spawned)
+  checkSTM $ M.size ws >= n + ts
+  bs <- traverse (\a -> (a $> False) `orElse` pure True) $ M.elems ws
+  -- If any wait would succeed its effects are rolled back by this retry
+  checkSTM $ and bs
+
+-- | Move time forward to a point in microseconds, running every timer that
+-- expires on the way, in order, and settling after each one.
+advanceTo :: MonadIO m => VirtualClock -> Int -> Word64 -> m ()
+advanceTo v n t = do
+  settle v n
+  fired <- atomically $ M.lookupMin <$> readTVar (v^.timers) >>= \case
+    Just ((d, i), a) | d <= t -> do
+      modifyTVar' (v^.timers) $ M.delete (d, i)
+      modifyTVar' (v^.now) $ max d
+      a
+      pure True
+    _ -> modifyTVar' (v^.now) (max t) $> False
+  when fired $ advanceTo v n t
+
+-- | Run all remaining timers, including those registered by other timers,
+-- moving time forward as required.
+drainTimers :: MonadIO m => VirtualClock -> Int -> m ()
+drainTimers v n = do
+  settle v n
+  M.lookupMin <$> readTVarIO (v^.timers) >>= \case
+    Nothing          -> pure ()
+    Just ((d, _), _) -> advanceTo v n d >> drainTimers v n
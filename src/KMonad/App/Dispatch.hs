@@ -42,6 +42,7 @@ module KMonad.App.Dispatch
 where
 
 import KMonad.Prelude
+import KMonad.App.Clock
 import KMonad.Keyboard
 
 import RIO.Seq (Seq(..), (><))
@@ -57,21 +58,22 @@ import qualified RIO.Text as T
 -- | The 'Dispatch' environment
 data Dispatch = Dispatch
   { _eventSrc :: IO KeyEvent            -- ^ How to read 1 event
+  , _clock    :: Clock                  -- ^ How to wait for events
   , _readProc :: TMVar (Async KeyEvent) -- ^ Store for reading process
   , _rerunBuf :: TVar (Seq KeyEvent)    -- ^ Buffer for rerunning events
   }
 makeLenses ''Dispatch
 
 -- | Create a new 'Dispatch' environment
-mkDispatch' :: MonadUnliftIO m => m KeyEvent -> m Dispatch
-mkDispatch' s = withRunInIO $ \u -> do
+mkDispatch' :: MonadUnliftIO m => Clock -> m KeyEvent -> m Dispatch
+mkDispatch' c s = withRunInIO $ \u -> do
   rpc <- atomically $ newEmptyTMVar
   rrb <- atomically $ newTVar Seq.empty
-  pure $ Dispatch (u s) rpc rrb
+  pure $ Dispatch (u s) c rpc rrb
 
 -- | Create a new 'Dispatch' environment in a 'ContT' environment
-mkDispatch :: MonadUnliftIO m => m KeyEvent -> ContT r m Dispatch
-mkDispatch = lift . mkDispatch'
+mkDispatch :: MonadUnliftIO m => Clock -> m KeyEvent -> ContT r m Dispatch
+mkDispatch c = lift . mkDispatch' c
 
 --------------------------------------------------------------------------------
 -- $op
@@ -87,12 +89,12 @@ pull d = do
   -- Check for an unfinished read attempt started previously. If it exists,
   -- fetch it, otherwise, start a new read attempt.
   a <- atomically (tryTakeTMVar $ d^.readProc) >>= \case
-    Nothing -> async . liftIO $ d^.eventSrc
+    Nothing -> spawn (d^.clock) (d^.eventSrc)
     Just a' -> pure a'
 
   -- First try reading from the rerunBuf, or failing that, from the
   -- read-process. If both fail we enter an STM race.
-  atomically ((Left <$> popRerun) `orElse` (Right <$> waitSTM a)) >>= \case
+  blockOn (d^.clock) ((Left <$> popRerun) `orElse` (Right <$> waitSTM a)) >>= \case
     -- If we take from the rerunBuf, put the running read-process back in place
     Left e' -> do
       logDebug $ "\n" <> display (T.replicate 80 "-")
@@ -0,0 +1,157 @@
+{-|
+Module      : KMonad.App.Heatmap
+Description : Component that counts key usage per layer
+Copyright   : (c) David Janssen, 2019
+License     : MIT
+Maintainer  : janssen.dhj@gmail.com
+Stability   : experimental
+Portability : portable
+
+The 'Heatmap' counts how often every 'Keycode' was pressed in every layer, and
+how often each 'Kind' of app-loop step happened, so that layouts can be
+evaluated without running a separate keylogger.
+
+All counters live in 1 flat, unboxed array that is only ever written from the
+app-loop thread. A separate thread periodically reads the array and writes it
+to a file, without taking any locks. Since it is only a report, we do not mind
+it being a few increments behind.
+
+The file is written to a temporary file first and then renamed, so readers never
+see a partial report. It contains 1 tab-separated line per nonzero counter:
+
+> key   <layer>  <keycode>  <presses>
+> kind  <kind>   <count>
+
+where presses of keys that are not in the keymap have @-@ as their layer. These
+are followed by the layers active when the report was written, read from the
+latest 'KMonad.App.Keymap.Snapshot', so that a report taken while a layer is
+stuck shows which 1:
+
+> stack  <version>  <layer>...
+> base   <layer>
+
+where the stack is front-most first, and the version counts the layer changes.
+
+-}
+module KMonad.App.Heatmap
+  ( Heatmap
+  , mkHeatmap
+  , pressed
+  , resolved
+  )
+where
+
+import KMonad.Prelude
+
+import Foreign.ForeignPtr
+import Foreign.Storable
+import RIO.Directory (renameFile)
+import RIO.List (intersperse)
+
+import KMonad.App.PerfCounters (Kind(..))
+import KMonad.App.Keymap (Keymap, readSnapshot, version, snapStack, snapBase)
+import KMonad.Keyboard
+import KMonad.Util
+
+import qualified RIO.HashMap as M
+import qualified RIO.Text    as T
+
+--------------------------------------------------------------------------------
+-- $env
+
+-- | The environment of an enabled 'Heatmap'
+data HmEnv = HmEnv
+  { _file    :: !FilePath                 -- ^ Where to write the report
+  , _layers  :: !(M.HashMap LayerTag Int) -- ^ The row of each layer
+  , _rows    :: ![Maybe LayerTag]         -- ^ The layer of each row, in order
+  , _kindOff :: !Int                      -- ^ Where the 'Kind' counters start
+  , _counts  :: !(ForeignPtr Word64)      -- ^ All the counters
+  , _keymap  :: !Keymap                   -- ^ Where to read the layers from
+  }
+makeLenses ''HmEnv
+
+-- | The 'Heatmap' environment, 'Nothing' when disabled
+newtype Heatmap = Heatmap (Maybe HmEnv)
+
+-- | How often the report is written
+exportInterval :: Milliseconds
+exportInterval = 60000
+
+-- | The number of 'Kind's we count
+nKinds :: Int
+nKinds = fromEnum (maxBound :: Kind) + 1
+
+-- | Create a 'Heatmap' that counts presses in the provided layers in a 'ContT'
+-- environment. When enabled, this writes the report every 'exportInterval', and
+-- once more when the continuation finishes.
+mkHeatmap :: HasLogFunc e
+  => Maybe FilePath -- ^ Where to write the report, 'Nothing' to disable
+  -> [LayerTag]     -- ^ All the layers in the keymap
+  -> Keymap         -- ^ The keymap whose layers to report
+  -> ContT r (RIO e) Heatmap
+mkHeatmap Nothing  _  _  = pure $ Heatmap Nothing
+mkHeatmap (Just f) ls km = ContT $ \next -> do
+  -- The last row collects the keys that were not found in any layer
+  let rs = map Just ls <> [Nothing]
+  let o  = length rs * nKeycodes
+  cs <- liftIO . mallocForeignPtrArray $ o + nKinds
+  liftIO . withForeignPtr cs $ \p -> for_ [0 .. o + nKinds - 1] $ \i ->
+    pokeElemOff p i 0
+  let h = HmEnv f (M.fromList $ zip ls [0..]) rs o cs km
+  logInfo $ "Writing key usage heatmap to: " <> fromString f
+  withAsync (exporter h) $ \_ ->
+    next (Heatmap $ Just h) `finally` export h
+
+-- | Write the report every 'exportInterval'
+exporter :: HasLogFunc e => HmEnv -> RIO e ()
+exporter h = forever $ do
+  threadDelay $ 1000 * fromIntegral exportInterval
+  export h
+
+-- | Write the report, warning instead of crashing when that fails
+export :: HasLogFunc e => HmEnv -> RIO e ()
+export h = handleIO warn $ do
+  let tmp = h^.file <> ".tmp"
+  writeFileUtf8Builder tmp =<< liftIO (report h)
+  renameFile tmp (h^.file)
+  where warn e = logWarn $ "Could not write heatmap: " <> displayShow e
+
+-- | Describe all nonzero counters, and the current layers
+report :: HmEnv -> IO Utf8Builder
+report h = withForeignPtr (h^.counts) $ \p -> do
+  ks <- for (zip [0..] $ h^.rows) $ \(r, l) ->
+    for [minBound .. maxBound :: Keycode] $ \c -> do
+      n <- peekElemOff p (r * nKeycodes + fromEnum c)
+      pure $ line ["key", maybe "-" display l, keyName c, display n] n
+  ds <- for [minBound .. maxBound :: Kind] $ \k -> do
+    n <- peekElemOff p (h^.kindOff + fromEnum k)
+    pure $ line ["kind", displayShow k, display n] n
+  s  <- readSnapshot $ h^.keymap
+  let ls = [ tsv $ ["stack", display $ s^.version] <> map display (s^.snapStack)
+           , tsv ["base", display $ s^.snapBase] ]
+  pure . mconcat $ concat ks <> ds <> ls
+  where
+    tsv fs    = mconcat (intersperse "\t" fs) <> "\n"
+    line fs n = if n == 0 then mempty else tsv fs
+    keyName   = display . T.dropAround (`elem` ['<', '>']) . textDisplay
+
+
+--------------------------------------------------------------------------------
+-- $op
+
+-- | Increment the counter at an index
+bump :: MonadIO m => HmEnv -> Int -> m ()
+bump h i = liftIO . withForeignPtr (h^.counts) $ \p ->
+  peekElemOff p i >>= pokeElemOff p i . (+1)
+
+-- | Count a press of a 'Keycode' that was found in a layer, or 'Nothing' if it
+-- was not in the keymap.
+pressed :: MonadIO m => Heatmap -> Maybe LayerTag -> Keycode -> m ()
+pressed (Heatmap Nothing)  _ _ = pure ()
+pressed (Heatmap (Just h)) l c = bump h $ r * nKeycodes + fromEnum c
+  where r = fromMaybe (M.size $ h^.layers) $ l >>= flip M.lookup (h^.layers)
+
+-- | Count something of a particular 'Kind' happening
+resolved :: MonadIO m => Heatmap -> Kind -> m ()
+resolved (Heatmap Nothing)  _ = pure ()
+resolved (Heatmap (Just h)) k = bump h $ h^.kindOff + fromEnum k
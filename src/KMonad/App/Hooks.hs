@@ -20,6 +20,8 @@ module KMonad.App.Hooks
   , mkHooks
   , pull
   , register
+  , count
+  , countSTM
   )
 where
 
@@ -29,6 +31,7 @@ import Data.Time.Clock.System
 import Data.Unique
 
 import KMonad.Action hiding (register)
+import KMonad.App.Clock
 import KMonad.Keyboard
 import KMonad.Util
 
@@ -66,21 +69,22 @@ type Store = M.HashMap Unique Entry
 -- different targets and callbacks.
 data Hooks = Hooks
   { _eventSrc   :: IO KeyEvent   -- ^ Where we get our events from
-  , _injectTmr  :: TMVar Unique  -- ^ Used to signal timeouts
+  , _clock      :: Clock         -- ^ How to tell time and time out hooks
+  , _injectTmr  :: TQueue Unique -- ^ Used to signal timeouts
   , _hooks      :: TVar Store    -- ^ Store of hooks
   }
 makeLenses ''Hooks
 
 -- | Create a new 'Hooks' environment which reads events from the provided action
-mkHooks' :: MonadUnliftIO m => m KeyEvent -> m Hooks
-mkHooks' s = withRunInIO $ \u -> do
-  itr <- atomically $ newEmptyTMVar
+mkHooks' :: MonadUnliftIO m => Clock -> m KeyEvent -> m Hooks
+mkHooks' c s = withRunInIO $ \u -> do
+  itr <- atomically $ newTQueue
   hks <- atomically $ newTVar M.empty
-  pure $ Hooks (u s) itr hks
+  pure $ Hooks (u s) c itr hks
 
 -- | Create a new 'Hooks' environment, but as a 'ContT' monad to avoid nesting
-mkHooks :: MonadUnliftIO m => m KeyEvent -> ContT r m Hooks
-mkHooks = lift . mkHooks'
+mkHooks :: MonadUnliftIO m => Clock -> m KeyEvent -> ContT r m Hooks
+mkHooks c = lift . mkHooks' c
 
 -- | Convert a hook in some UnliftIO monad into an IO version, to store it in Hooks
 ioHook :: MonadUnliftIO m => Hook m -> m (Hook IO)
@@ -107,16 +111,15 @@ register :: (HasLogFunc e)
 register hs h = do
   -- Insert an entry into the store
   tag <- liftIO newUnique
-  e   <- Entry <$> liftIO getSystemTime <*> ioHook h
+  e   <- Entry <$> getTime (hs^.clock) <*> ioHook h
   atomically $ modifyTVar (hs^.hooks) (M.insert tag e)
-  -- If the hook has a timeout, start a thread that will signal timeout
+  -- If the hook has a timeout, schedule the signal for that timeout
   case h^.hTimeout of
     Nothing -> logDebug $ "Registering untimed hook: " <> display (hashUnique tag)
-    Just t' -> void . async $ do
+    Just t' -> do
       logDebug $ "Registering " <> display (t'^.delay)
               <> "ms hook: " <> display (hashUnique tag)
-      threadDelay $ 1000 * (fromIntegral $ t'^.delay)
-      atomically $ putTMVar (hs^.injectTmr) tag
+      schedule (hs^.clock) (t'^.delay) $ writeTQueue (hs^.injectTmr) tag
 
 -- | Cancel a hook by removing it from the store
 cancelHook :: (HasLogFunc e)
@@ -136,6 +139,14 @@ cancelHook hs tag = do
       logDebug $ "Cancelling hook: " <> display (hashUnique tag)
       liftIO $ e' ^. hTimeout . to fromJust . action
 
+-- | Return the number of hooks currently waiting in the store
+count :: MonadIO m => Hooks -> m Int
+count hs = M.size <$> readTVarIO (hs^.hooks)
+
+-- | Like 'count', but in 'STM', so that other threads can wait for it to change
+countSTM :: Hooks -> STM Int
+countSTM hs = M.size <$> readTVar (hs^.hooks)
+
 
 --------------------------------------------------------------------------------
 -- $run
@@ -156,7 +167,7 @@ runHooks :: (HasLogFunc e)
 runHooks hs e = do
   logDebug "Running hooks"
   m   <- atomically $ swapTVar (hs^.hooks) M.empty
-  now <- liftIO getSystemTime
+  now <- getTime (hs^.clock)
   foldMapM (runEntry now e) (M.elems m) >>= \case
     Catch   -> pure $ Nothing
     NoCatch -> pure $ Just e
@@ -180,14 +191,14 @@ step :: (HasLogFunc e)
 step h = do
 
   -- Asynchronously start reading the next event
-  a <- async . liftIO $ h^.eventSrc
+  a <- spawn (h^.clock) (h^.eventSrc)
  
   -- Handle any timer event first, and then try to read from the source
-  let next = (Left <$> takeTMVar (h^.injectTmr)) `orElse` (Right <$> waitSTM a)
+  let next = (Left <$> readTQueue (h^.injectTmr)) `orElse` (Right <$> waitSTM a)
 
   -- Keep taking and cancelling timers until we encounter a key event, then run
   -- the hooks on that event.
-  let read = atomically next >>= \case
+  let read = blockOn (h^.clock) next >>= \case
         Left  t -> cancelHook h t >> read -- We caught a cancellation
         Right e -> runHooks h e           -- We caught a real event
   read
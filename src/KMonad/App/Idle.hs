@@ -0,0 +1,211 @@
+{-|
+Module      : KMonad.App.Idle
+Description : Component that keeps track of when KMonad is idle
+Copyright   : (c) David Janssen, 2019
+License     : MIT
+Maintainer  : janssen.dhj@gmail.com
+Stability   : experimental
+Portability : portable
+
+KMonad is 'idle' when no keys are held and no hooks are waiting for events or
+timeouts. In that state nothing can happen until the OS sends us a new event, so
+KMonad does no work at all. Together with running without the idle GC (@+RTS
+-I0@, which is the default), this lets the runtime stop its timer, so an idle
+KMonad causes no CPU wakeups.
+
+To be able to verify this, we can count how often the threads of this process
+were woken up while idle, and report that when we leave the idle state. This
+reads a file per thread, so it is opt-in, and done by a separate thread that
+only runs when the idle state starts and ends.
+
+Idle periods are also natural gaps in the user's typing, which makes them the
+best time to collect garbage. When configured with a GC delay, a thread that
+lives as long as KMonad runs a major GC once we have been idle for that long, so
+that the collections that happen while typing can stay minor. Its timer is never
+cancelled: when a key arrives first, the thread just finds that the idle period
+it was timing has ended. This costs 1 timer wakeup per idle period.
+
+The 'Idle' component gets called right before we start waiting on the OS for a
+new event ('waiting') and right after we receive one ('arrived'). Both of these
+happen in the thread reading from the OS, never at the same time, and only
+update a few references.
+
+When hooks are still waiting as we start reading (like a tap-hold or an 'after'
+timer that will time out), we are not idle yet, but will be once they are gone.
+For that case a third thread watches the number of hooks while we read, and
+enters the idle state once it drops to 0. It only wakes up in such gaps, so it
+costs nothing while typing.
+
+-}
+module KMonad.App.Idle
+  ( Idle
+  , mkIdle
+  , watchPending
+  , waiting
+  , arrived
+  , wakeups
+  )
+where
+
+import KMonad.Prelude
+
+import GHC.Clock (getMonotonicTimeNSec)
+import RIO.Directory (listDirectory)
+import System.Mem (performMajorGC)
+
+import KMonad.Keyboard
+import KMonad.Util
+
+import qualified RIO.HashSet as S
+import qualified RIO.Text    as T
+
+--------------------------------------------------------------------------------
+-- $env
+
+-- | The 'Idle' environment
+data Idle = Idle
+  { _pending   :: IORef (STM Int)           -- ^ How to count waiting hooks
+  , _held      :: IORef (S.HashSet Keycode) -- ^ The keys currently held
+  , _blocked   :: TVar Bool                 -- ^ Reading, but waiting on hooks
+  , _idleSince :: TVar Word64               -- ^ When idle started, 0 when busy
+  }
+makeLenses ''Idle
+
+-- | Create a new 'Idle' environment
+mkIdle' :: MonadIO m => m Idle
+mkIdle' = Idle <$> newIORef (pure 0) <*> newIORef S.empty
+               <*> newTVarIO False <*> newTVarIO 0
+
+-- | Create a new 'Idle' environment in a 'ContT' environment, starting the
+-- threads that run the idle GC and count wakeups, if asked to.
+mkIdle :: HasLogFunc e
+  => Maybe Milliseconds -- ^ Idle time before we GC
+  -> Bool               -- ^ Whether to count wakeups while idle
+  -> ContT r (RIO e) Idle
+mkIdle d w = do
+  i <- lift mkIdle'
+  -- Nothing uses the idle state otherwise
+  when (isJust d || w) $ launch_ "idle_hooks" (watchHooks i)
+  for_ d $ \d' -> launch_ "idle_gc" (gcIdle d' i)
+  when w $ launch_ "idle_wakeups" (sampleIdle i)
+  pure i
+
+-- | Set the action used to count how many hooks are still waiting.
+--
+-- NOTE: This is not passed to 'mkIdle', because the 'Idle' environment is
+-- required to create the hooks in the first place.
+watchPending :: MonadIO m => Idle -> STM Int -> m ()
+watchPending i = writeIORef (i^.pending)
+
+
+--------------------------------------------------------------------------------
+-- $op
+
+-- | Called right before waiting on the OS. If no keys are held and no hooks are
+-- waiting, enter the idle state. If only hooks are waiting, leave it to
+-- 'watchHooks' to enter it once they are gone.
+waiting :: HasLogFunc e => Idle -> RIO e ()
+waiting i = do
+  free <- S.null <$> readIORef (i^.held)
+  idle <- (/= 0) <$> readTVarIO (i^.idleSince)
+  when (free && not idle) $ do
+    n <- readIORef (i^.pending) >>= atomically
+    if n == 0
+      then liftIO getMonotonicTimeNSec >>= atomically . writeTVar (i^.idleSince)
+      else atomically $ writeTVar (i^.blocked) True
+
+-- | Called with every event received from the OS. Keep track of held keys, and
+-- if we were idle (or about to be), leave the idle state.
+arrived :: HasLogFunc e => Idle -> KeyEvent -> RIO e ()
+arrived i e = do
+  modifyIORef' (i^.held) $
+    if isPress e then S.insert (e^.keycode) else S.delete (e^.keycode)
+  idle <- (/= 0) <$> readTVarIO (i^.idleSince)
+  blk  <- readTVarIO (i^.blocked)
+  when (idle || blk) . atomically $ do
+    writeTVar (i^.idleSince) 0
+    writeTVar (i^.blocked) False
+
+-- | While we read from the OS with only hooks waiting, enter the idle state once
+-- the last hook is gone (like when a tap-hold or 'after' times out). If a
+-- timeout registers new hooks after that, leave it again.
+watchHooks :: Idle -> RIO e ()
+watchHooks i = do
+  -- Only ever woken up while blocked, never while typing
+  atomically $ readTVar (i^.blocked) >>= checkSTM
+  cnt  <- readIORef (i^.pending)
+  gone <- atomically $ do
+    b <- readTVar (i^.blocked)
+    n <- cnt
+    checkSTM $ not b || n == 0
+    pure b
+  when gone $ do
+    t <- liftIO getMonotonicTimeNSec
+    entered <- atomically $ do
+      b <- readTVar (i^.blocked)
+      n <- cnt
+      let e = b && n == 0
+      when e $ writeTVar (i^.blocked) False >> writeTVar (i^.idleSince) t
+      pure e
+    when entered . atomically $ do
+      s <- readTVar (i^.idleSince)
+      n <- cnt
+      checkSTM $ s /= t || n > 0
+      when (s == t) $ writeTVar (i^.idleSince) 0 >> writeTVar (i^.blocked) True
+
+-- | Wait for an idle period to start, and run a major GC once it has lasted for
+-- a delay. If the period ends before that, go back to waiting for the next one.
+gcIdle :: HasLogFunc e => Milliseconds -> Idle -> RIO e ()
+gcIdle d i = do
+  t   <- atomically $ readTVar (i^.idleSince) >>= \t -> t <$ checkSTM (t /= 0)
+  now <- liftIO getMonotonicTimeNSec
+  let due = t + 1000000 * fromIntegral d
+  when (due > now) . threadDelay . fromIntegral $ (due - now) `div` 1000
+  whenM ((== t) <$> readTVarIO (i^.idleSince)) $ do
+    liftIO performMajorGC
+    logDebug "Performed idle GC"
+    -- Collect only once per idle period
+    atomically $ readTVar (i^.idleSince) >>= checkSTM . (/= t)
+
+-- | Wait for 1 idle period to start and end, and report how many wakeups it
+-- contained. This only wakes up at the start and at the end of the period, so
+-- it adds no wakeups of its own.
+sampleIdle :: HasLogFunc e => Idle -> RIO e ()
+sampleIdle i = do
+  t  <- atomically $ readTVar (i^.idleSince) >>= \t -> t <$ checkSTM (t /= 0)
+  w  <- liftIO wakeups
+  logDebug "Entering idle state"
+  atomically $ readTVar (i^.idleSince) >>= checkSTM . (/= t)
+  t' <- liftIO getMonotonicTimeNSec
+  w' <- liftIO wakeups
+  let ms  = (t' - t) `div` 1000000
+  let rep = "Leaving idle state after " <> display ms <> "ms, " <>
+        case (w, w') of
+          (Just a, Just b) -> perSecond ms (b - a)
+          _                -> "wakeups unavailable"
+  -- Short pauses between keystrokes are not worth an info message
+  (if ms >= 1000 then logInfo else logDebug) rep
+
+-- | Display a number of wakeups over a period of milliseconds
+perSecond :: Word64 -> Int -> Utf8Builder
+perSecond ms n = let r = (fromIntegral n * 10000) `div` max 1 ms in
+  display n <> " wakeups (" <> display (r `div` 10) <> "."
+            <> display (r `mod` 10) <> " per second)"
+
+-- | Count how often any thread of this process voluntarily gave up the CPU,
+-- which is how often it went to sleep and had to be woken up again.
+--
+-- NOTE: This reads the Linux @/proc@ filesystem, so on other OSes we simply
+-- return 'Nothing'.
+wakeups :: IO (Maybe Int)
+wakeups = handleIO (const $ pure Nothing) $ do
+  ts <- listDirectory "/proc/self/task"
+  Just . sum <$> mapM switches ts
+  where
+    -- Threads can disappear while we are looking at them
+    switches t = handleIO (const $ pure 0) $
+      sum . mapMaybe field . lines
+        <$> readFileUtf8 ("/proc/self/task/" <> t <> "/status")
+    field l = case T.words l of
+      ["voluntary_ctxt_switches:", v] -> readMaybe (T.unpack v)
+      _                               -> Nothing
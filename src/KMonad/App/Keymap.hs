@@ -12,12 +12,24 @@ mechanisms. It is the button-presses that get handled through a keymap. It is
 the 'Keymap' component that manages the keymap state and ensures that
 incoming events are mapped to
 
+The loop thread owns the 'Keymap' and is the only one to touch its state
+directly. After every change it publishes an immutable, versioned 'Snapshot' of
+that state, which any other thread can read with 'readSnapshot' without ever
+waiting on, or slowing down, the loop. A 'Snapshot' is plain data: the layer
+names and the 'Button' bound to every key, never the 'BEnv's that hold the
+loop's mutable button state.
+
 -}
 module KMonad.App.Keymap
   ( Keymap
   , mkKeymap
   , layerOp
   , lookupKey
+
+    -- * Snapshots
+  , Snapshot
+  , HasSnapshot(..)
+  , readSnapshot
   )
 where
 
@@ -30,19 +42,32 @@ import KMonad.Keyboard
 import KMonad.App.BEnv
 
 import qualified Data.LayerStack as Ls
+import qualified RIO.HashMap     as M
 
 --------------------------------------------------------------------------------
 -- $env
 --
 
 
+-- | An immutable copy of the state of the 'Keymap' at some point in time
+data Snapshot = Snapshot
+  { _version   :: !Int        -- ^ Incremented on every published change
+  , _snapStack :: ![LayerTag] -- ^ The layer-stack, front-most first
+  , _snapBase  :: !LayerTag   -- ^ The base-layer
+  , _snapKeys  :: !(M.HashMap (LayerTag, Keycode) Button)
+    -- ^ The 'Button' bound to every key, per layer
+  }
+makeClassy ''Snapshot
+
 -- | The 'Keymap' environment containing the current keymap
 --
 -- NOTE: Since the 'Keymap' will never have to deal with anything
--- asynchronously we can simply use 'IORef's here.
+-- asynchronously we can simply use 'IORef's here. Other threads only ever read
+-- '_published', which the loop replaces as a whole.
 data Keymap = Keymap
-  { _stack :: IORef (LMap BEnv)
-  , _baseL :: IORef LayerTag
+  { _stack     :: IORef (LMap BEnv)
+  , _baseL     :: IORef LayerTag
+  , _published :: IORef Snapshot
   }
 makeClassy ''Keymap
 
@@ -55,6 +80,7 @@ mkKeymap' :: MonadUnliftIO m
 mkKeymap' n m = do
   envs <- m & Ls.items . itraversed %%@~ \(_, c) b -> initBEnv b c
   Keymap <$> newIORef envs <*> newIORef n
+         <*> newIORef (Snapshot 0 (m^.Ls.stack) n (m^.Ls.items))
 
 -- | Create a 'Keymap' but do so in the context of a 'ContT' monad to ease nesting.
 mkKeymap :: MonadUnliftIO m => LayerTag -> LMap Button -> ContT r m Keymap
@@ -67,6 +93,17 @@ mkKeymap n = lift . mkKeymap' n
 -- The following code describes how we add and remove layers from the
 -- 'Keymap'.
 
+-- | Publish the current state as the next 'Snapshot'. Only the loop thread
+-- calls this, so there is never a competing writer.
+publish :: MonadIO m => Keymap -> m ()
+publish h = do
+  old <- readIORef (h^.published)
+  st  <- view Ls.stack <$> readIORef (h^.stack)
+  b   <- readIORef (h^.baseL)
+  -- The bindings never change, so every snapshot shares the first one's
+  atomicWriteIORef (h^.published) $
+    Snapshot (old^.version + 1) st b (old^.snapKeys)
+
 -- | Print a header message followed by an enumeration of the layer-stack
 debugReport :: HasLogFunc e => Keymap -> Utf8Builder -> RIO e ()
 debugReport h hdr = do
@@ -87,18 +124,21 @@ layerOp h o = let km = h^.stack in case o of
     Ls.pushLayer n <$> readIORef km >>= \case
       Left e   -> throwIO e
       Right m' -> writeIORef km m'
+    publish h
     debugReport h $ "Pushed layer to stack: " <> display n
 
   (PopLayer n) -> do
     Ls.popLayer n <$> readIORef km >>= \case
       Left e   -> throwIO e
       Right m' -> writeIORef km m'
+    publish h
     debugReport h $ "Popped layer from stack: " <> display n
 
   (SetBaseLayer n) -> do
-    (n `elem`) . view Ls.maps <$> (readIORef km) >>= \case
+    view (Ls.maps . contains n) <$> (readIORef km) >>= \case
       True  -> writeIORef (h^.baseL) n
       False -> throwIO $ Ls.LayerDoesNotExist n
+    publish h
     debugReport h $ "Set base layer to: " <> display n
 
 
@@ -107,15 +147,20 @@ layerOp h o = let km = h^.stack in case o of
 --
 -- How we use the 'Keymap' to handle events.
 
--- | Lookup the 'BEnv' currently mapped to the key press.
+-- | Lookup the 'BEnv' currently mapped to the key press, along with the layer
+-- it was found in.
 lookupKey :: MonadIO m
-  => Keymap   -- ^ The 'Keymap' to lookup in
-  -> Keycode        -- ^ The 'Keycode' to lookup
-  -> m (Maybe BEnv) -- ^ The resulting action
+  => Keymap                     -- ^ The 'Keymap' to lookup in
+  -> Keycode                    -- ^ The 'Keycode' to lookup
+  -> m (Maybe (LayerTag, BEnv)) -- ^ The resulting action
 lookupKey h c = do
   m <- readIORef $ h^.stack
   f <- readIORef $ h^.baseL
 
-  pure $ case m ^? Ls.atKey c of
-    Nothing -> m ^? Ls.inLayer f c
-    benv    -> benv
+  let inL l = (l,) <$> m ^? Ls.inLayer l c
+  pure $ asum (map inL $ m^.Ls.stack) <|> inL f
+
+-- | Return the most recently published 'Snapshot'. This never blocks, and is
+-- safe to call from any thread.
+readSnapshot :: MonadIO m => Keymap -> m Snapshot
+readSnapshot h = readIORef $ h^.published
@@ -0,0 +1,185 @@
+{-# LANGUAGE CPP #-}
+{-|
+Module      : KMonad.App.PerfCounters
+Description : Hardware performance counters per processed event
+Copyright   : (c) David Janssen, 2019
+License     : MIT
+Maintainer  : janssen.dhj@gmail.com
+Stability   : experimental
+Portability : non-portable (FFI to Linux-only c-code)
+
+The 'PerfCounters' component uses @perf_event_open@ to count CPU cycles,
+instructions, and cache misses spent on every step of the app-loop. Each step is
+classified by the most involved thing that happened during it, and when KMonad
+shuts down we log the average cost per 'Kind' of step.
+
+NOTE: The counters are opened for the calling OS thread. Since the app-loop runs
+in the (bound) main thread, this counts all work done by the pull-chain, the
+hooks and the button actions, but not the reading and emitting that happens in
+other threads. Time spent blocked waiting for events is not counted.
+
+On anything but Linux, this component is always disabled.
+
+-}
+module KMonad.App.PerfCounters
+  ( PerfCounters
+  , mkPerfCounters
+  , Kind(..)
+  , begin
+  , classify
+  , end
+  )
+where
+
+import KMonad.Prelude
+
+import Foreign.C.Types
+import Foreign.Marshal hiding (void)
+import Foreign.Ptr
+import Foreign.Storable
+
+import qualified RIO.Map as M
+
+--------------------------------------------------------------------------------
+-- $ffi
+
+#ifdef linux_HOST_OS
+
+foreign import ccall unsafe "perf_counters_open"
+  c_perf_counters_open :: Ptr CInt -> IO CInt
+
+foreign import ccall unsafe "perf_counters_read"
+  c_perf_counters_read :: CInt -> Ptr Word64 -> IO CInt
+
+foreign import ccall unsafe "perf_counters_close"
+  c_perf_counters_close :: Ptr CInt -> IO ()
+
+#else
+
+c_perf_counters_open :: Ptr CInt -> IO CInt
+c_perf_counters_open _ = pure (-1)
+
+c_perf_counters_read :: CInt -> Ptr Word64 -> IO CInt
+c_perf_counters_read _ _ = pure (-1)
+
+c_perf_counters_close :: Ptr CInt -> IO ()
+c_perf_counters_close _ = pure ()
+
+#endif
+
+--------------------------------------------------------------------------------
+-- $env
+
+-- | The different kinds of app-loop steps we keep separate totals for. When
+-- multiple things happen in 1 step, the step is counted as the greatest 'Kind'.
+data Kind
+  = OtherEvent  -- ^ An event that was not a press reached the keymap
+  | PlainKey    -- ^ A press was handled by a button in the keymap
+  | Fallthrough -- ^ A press was not in the keymap and was emitted as-is
+  | LayerChange -- ^ A layer-operation was performed
+  | Resolution  -- ^ A held decision (like a tap-hold) was resolved
+  deriving (Eq, Ord, Show, Enum, Bounded)
+
+-- | Running totals for 1 'Kind'
+data Totals = Totals
+  { _steps  :: !Word64
+  , _cycles :: !Word64
+  , _instrs :: !Word64
+  , _misses :: !Word64
+  }
+
+instance Semigroup Totals where
+  Totals a b c d <> Totals a' b' c' d' = Totals (a + a') (b + b') (c + c') (d + d')
+
+-- | The environment of enabled 'PerfCounters'
+data PcEnv = PcEnv
+  { _fds    :: !(Ptr CInt)                        -- ^ The 3 counter descriptors
+  , _now    :: !(Ptr Word64)                      -- ^ Buffer to read counters into
+  , _start  :: !(IORef (Word64, Word64, Word64))  -- ^ Counters at start of step
+  , _kind   :: !(IORef Kind)                      -- ^ Classification of this step
+  , _totals :: !(IORef (M.Map Kind Totals))       -- ^ Totals per 'Kind'
+  }
+makeLenses ''PcEnv
+
+-- | The 'PerfCounters' environment, 'Nothing' when disabled
+newtype PerfCounters = PerfCounters (Maybe PcEnv)
+
+-- | Create a 'PerfCounters' environment in a 'ContT' environment. When enabled,
+-- this opens the counters for the calling thread, and reports the totals and
+-- closes the counters when the continuation finishes.
+mkPerfCounters :: HasLogFunc e => Bool -> ContT r (RIO e) PerfCounters
+mkPerfCounters False = pure $ PerfCounters Nothing
+mkPerfCounters True  = ContT $ \next ->
+  bracket pcOpen pcClose (next . PerfCounters)
+
+-- | Try to open the counters, warn and return 'Nothing' when that fails
+pcOpen :: HasLogFunc e => RIO e (Maybe PcEnv)
+pcOpen = do
+  fds <- liftIO $ mallocArray 3
+  liftIO (c_perf_counters_open fds) >>= \case
+    0 -> do
+      logInfo "Opened hardware performance counters"
+      env <- PcEnv fds <$> liftIO (mallocArray 3)
+                       <*> newIORef (0, 0, 0)
+                       <*> newIORef OtherEvent
+                       <*> newIORef M.empty
+      pure $ Just env
+    _ -> do
+      logWarn "Could not open hardware performance counters, is perf_event_paranoid > 2?"
+      liftIO $ free fds
+      pure Nothing
+
+-- | Report the totals and close the counters
+pcClose :: HasLogFunc e => Maybe PcEnv -> RIO e ()
+pcClose Nothing  = pure ()
+pcClose (Just p) = do
+  ts <- readIORef (p^.totals)
+  logInfo . mconcat $ "Hardware counters per app-loop step:"
+    : map (uncurry report) (M.toList ts)
+  liftIO $ do
+    c_perf_counters_close (p^.fds)
+    free (p^.fds)
+    free (p^.now)
+  where
+    report k t = let per f = display (f t `div` max 1 (_steps t)) in mconcat
+      [ "\n  ", displayShow k, ": ", display (_steps t), " steps, "
+      , per _cycles, " cycles, ", per _instrs, " instructions, "
+      , per _misses, " cache-misses per step"
+      ]
+
+
+--------------------------------------------------------------------------------
+-- $op
+
+-- | Read the current counter values
+readCounters :: PcEnv -> IO (Maybe (Word64, Word64, Word64))
+readCounters p = do
+  fd <- peek (p^.fds)
+  c_perf_counters_read fd (p^.now) >>= \case
+    0 -> do
+      let rd = peekElemOff (p^.now)
+      Just <$> ((,,) <$> rd 0 <*> rd 1 <*> rd 2)
+    _ -> pure Nothing
+
+-- | Start counting a new step of the app-loop
+begin :: MonadIO m => PerfCounters -> m ()
+begin (PerfCounters Nothing)  = pure ()
+begin (PerfCounters (Just p)) = liftIO $ do
+  writeIORef (p^.kind) OtherEvent
+  readCounters p >>= traverse_ (writeIORef (p^.start))
+
+-- | Note that something of a particular 'Kind' happened during this step
+classify :: MonadIO m => PerfCounters -> Kind -> m ()
+classify (PerfCounters Nothing)  _ = pure ()
+classify (PerfCounters (Just p)) k = modifyIORef' (p^.kind) (max k)
+
+-- | Finish counting the current step and add it to the totals
+end :: MonadIO m => PerfCounters -> m ()
+end (PerfCounters Nothing)  = pure ()
+end (PerfCounters (Just p)) = liftIO $ readCounters p >>= \case
+  Nothing        -> pure ()
+  Just (c, i, m) -> do
+    (c0, i0, m0) <- readIORef (p^.start)
+    k <- readIORef (p^.kind)
+    let t = Totals 1 (c - c0) (i - i0) (m - m0)
+    modifyIORef' (p^.totals) (M.insertWith (<>) k t)
@@ -17,6 +17,7 @@ module KMonad.App.Sluice
   , mkSluice
   , block
   , unblock
+  , depth
   , pull
   )
 where
@@ -91,6 +92,10 @@ unblock s = do
       logDebug $ "Block level set to: " <> display n
       pure []
 
+-- | Return the number of events currently stored in the 'Sluice'
+depth :: MonadIO m => Sluice -> m Int
+depth s = length <$> readIORef (s^.blockBuf)
+
 
 --------------------------------------------------------------------------------
 -- $loop
@@ -0,0 +1,121 @@
+{-|
+Module      : KMonad.App.Tap
+Description : Mirroring the events of the app-loop to external consumers
+Copyright   : (c) David Janssen, 2019
+License     : MIT
+Maintainer  : janssen.dhj@gmail.com
+Stability   : experimental
+Portability : portable
+
+A 'Tap' mirrors the events passing a point of the app-loop to a file, usually a
+named pipe (see mkfifo(1)) read by something like an on-screen key display or a
+test oracle. Events are written in the trace format (see "KMonad.Trace"), so
+what a tap on the input wrote can also be read by @kmonad trace analyze@.
+
+The app-loop only ever puts events into a bounded queue, without waiting. A
+separate thread takes them out in batches, and writes each batch out at once.
+When the consumer does not keep up the queue fills, after which new events are
+dropped and counted instead of ever slowing down KMonad. Batches that fail to be
+written are counted as dropped as well.
+
+The file is opened once. A named pipe stays open while readers come and go, so a
+reader that attaches later first gets whatever the pipe still holds, and only
+the first reader sees the header. A regular file is appended to, and only gets
+a header when it is empty.
+
+-}
+module KMonad.App.Tap
+  ( Tap
+  , mkTap
+  , tap
+  )
+where
+
+import KMonad.Prelude
+
+import GHC.Clock (getMonotonicTimeNSec)
+
+import KMonad.Keyboard
+import KMonad.Trace
+
+import qualified RIO.ByteString as B
+
+--------------------------------------------------------------------------------
+-- $env
+
+-- | The most events that can wait to be written before we start dropping them
+tapCapacity :: Natural
+tapCapacity = 4096
+
+-- | The environment of a tap that is enabled
+data TapEnv = TapEnv
+  { _queue   :: TBQueue TraceEvent -- ^ Events waiting to be written
+  , _dropped :: IORef Int          -- ^ Events lost to a slow consumer
+  , _start   :: Word64             -- ^ Monotonic time the tap was opened, in ns
+  }
+makeLenses ''TapEnv
+
+-- | A point in the app-loop that mirrors events. 'Nothing' when disabled.
+newtype Tap = Tap (Maybe TapEnv)
+
+-- | Create a 'Tap' in a 'ContT' environment, writing to a file. The name is only
+-- used for logging.
+mkTap :: HasLogFunc e => Text -> Maybe FilePath -> ContT r (RIO e) Tap
+mkTap _ Nothing  = pure $ Tap Nothing
+mkTap n (Just f) = ContT $ \next -> do
+  env <- TapEnv <$> newTBQueueIO tapCapacity <*> newIORef 0
+                <*> liftIO getMonotonicTimeNSec
+  logInfo $ "Mirroring " <> display n <> " events to: " <> fromString f
+  withAsync (writer env) $ \_ -> next (Tap $ Just env) `finally` do
+    d <- readIORef $ env^.dropped
+    when (d > 0) . logWarn $
+      "Dropped " <> display d <> " " <> display n <> " events that could not "
+      <> "be written to " <> fromString f <> " in time"
+  where
+    -- We open the file once and never poll for readers. A named pipe is opened
+    -- for reading as well as writing, which never waits for a reader and never
+    -- fails once a reader leaves: while nobody reads, the pipe and then the
+    -- queue fill up, and the writer sleeps. A regular file is appended to.
+    writer env = handleIO (logWarn . cannot) $
+      withBinaryFile f ReadWriteMode $ \h -> prepare h >> forever (batch env h)
+
+    -- Write out everything that is queued, counting it as dropped on failure
+    batch env h = do
+      es <- atomically $ do
+        es <- flushTBQueue $ env^.queue
+        checkSTM . not $ null es
+        pure es
+      tryIO (traverse_ (writeEvent h) es >> hFlush h) >>= \case
+        Right () -> pure ()
+        Left e   -> do
+          modifyIORef' (env^.dropped) (+ length es)
+          logDebug $ cannot e
+
+    cannot e = "Cannot mirror " <> display n <> " events: " <> displayShow e
+
+-- | Prepare a freshly opened tap for writing, and write the trace header if the
+-- file is new.
+--
+-- NOTE: A named pipe is not seekable, which is how we tell it from a file
+-- without any OS-specific calls.
+prepare :: MonadIO m => Handle -> m ()
+prepare h = do
+  hSetBuffering h $ BlockBuffering Nothing
+  new <- hIsSeekable h >>= \case
+    False -> pure True
+    True  -> do
+      hSeek h SeekFromEnd 0
+      (== 0) <$> hFileSize h
+  when new $ liftIO (B.hPut h traceHeader) >> hFlush h
+
+-- | Mirror an event, or drop it if the consumer is too far behind. This never
+-- blocks.
+tap :: MonadIO m => Tap -> KeyEvent -> m ()
+tap (Tap Nothing)    _ = pure ()
+tap (Tap (Just env)) e = do
+  now <- liftIO getMonotonicTimeNSec
+  let te = TraceEvent ((now - env^.start) `div` 1000) e
+  ok <- atomically $ isFullTBQueue (env^.queue) >>= \case
+    True  -> pure False
+    False -> writeTBQueue (env^.queue) te $> True
+  unless ok $ modifyIORef' (env^.dropped) (+1)
@@ -0,0 +1,184 @@
+{-|
+Module      : KMonad.App.Watchdog
+Description : Component that reports events that take too long to process
+Copyright   : (c) David Janssen, 2019
+License     : MIT
+Maintainer  : janssen.dhj@gmail.com
+Stability   : experimental
+Portability : portable
+
+The 'Watchdog' keeps track of when an event was returned by 'awaitKey' and when
+it passed through the different stages of the app-loop. If the total time
+between receiving an event and finishing its processing exceeds a configured
+threshold, we log the stage timings along with a dump of the app-loop state and
+the GC statistics at that moment.
+
+The app-loop only hands events to the emitter thread, which writes them to the
+OS and flushes the sink whenever nothing else is waiting. That write is timed on
+its own, from taking the event to finishing the flush, and reported when it
+alone exceeds the threshold.
+
+When everything is under threshold, the only cost is reading the monotonic
+clock a few times per event. When no threshold is configured, all operations are
+no-ops.
+
+NOTE: We only time events that come fresh from the OS. Events that are rerun
+(after unblocking the 'KMonad.App.Sluice.Sluice' or through an 'inject') have
+been intentionally delayed, so we call 'rerunning' to forget the stored
+timestamp whenever that happens.
+
+-}
+module KMonad.App.Watchdog
+  ( Watchdog
+  , mkWatchdog
+  , Stage(..)
+  , received
+  , rerunning
+  , mark
+  , check
+  , writing
+  , written
+  )
+where
+
+import KMonad.Prelude
+
+import GHC.Clock (getMonotonicTimeNSec)
+import GHC.Stats
+
+import KMonad.Util
+
+--------------------------------------------------------------------------------
+-- $env
+
+-- | The stages of the app-loop that we record timestamps for
+data Stage
+  = Pulled   -- ^ The event made it through the pull-chain
+  | LookedUp -- ^ The event was looked up in the keymap
+  | Queued   -- ^ An event was handed to the emitter
+  deriving (Eq, Show)
+
+-- | Timestamps in nanoseconds, 0 meaning 'not reached'
+data Stamps = Stamps
+  { _pullT :: !Word64
+  , _lookT :: !Word64
+  , _queuT :: !Word64
+  }
+makeLenses ''Stamps
+
+-- | The environment of an active 'Watchdog'
+--
+-- NOTE: '_recvAt' is written from the thread that calls 'awaitKey', while all
+-- the other stamps are only ever touched from the app-loop thread.
+data WdEnv = WdEnv
+  { _threshold :: !Word64        -- ^ Threshold in nanoseconds
+  , _recvAt    :: !(IORef Word64) -- ^ When the last event was received
+  , _stamps    :: !(IORef Stamps) -- ^ When the stages were reached
+  }
+makeLenses ''WdEnv
+
+-- | The 'Watchdog' environment, 'Nothing' when disabled
+newtype Watchdog = Watchdog (Maybe WdEnv)
+
+-- | Create a new 'Watchdog', which does nothing if no threshold is provided
+mkWatchdog' :: MonadIO m => Maybe Milliseconds -> m Watchdog
+mkWatchdog' Nothing   = pure $ Watchdog Nothing
+mkWatchdog' (Just ms) = do
+  rcv <- newIORef 0
+  stm <- newIORef noStamps
+  pure . Watchdog . Just $ WdEnv (1000000 * fromIntegral ms) rcv stm
+
+-- | Create a new 'Watchdog' in a 'ContT' environment
+mkWatchdog :: MonadIO m => Maybe Milliseconds -> ContT r m Watchdog
+mkWatchdog = lift . mkWatchdog'
+
+-- | The empty set of stamps
+noStamps :: Stamps
+noStamps = Stamps 0 0 0
+
+
+--------------------------------------------------------------------------------
+-- $op
+
+-- | Record that an event was just returned by 'awaitKey'
+received :: MonadIO m => Watchdog -> m ()
+received (Watchdog Nothing)  = pure ()
+received (Watchdog (Just w)) = liftIO $
+  getMonotonicTimeNSec >>= atomicWriteIORef (w^.recvAt)
+
+-- | Forget the last received event, because the next events will be reruns
+rerunning :: MonadIO m => Watchdog -> m ()
+rerunning (Watchdog Nothing)  = pure ()
+rerunning (Watchdog (Just w)) = atomicWriteIORef (w^.recvAt) 0
+
+-- | Record that the current event has reached a 'Stage'
+mark :: MonadIO m => Watchdog -> Stage -> m ()
+mark (Watchdog Nothing)  _ = pure ()
+mark (Watchdog (Just w)) s = liftIO $ do
+  t <- getMonotonicTimeNSec
+  modifyIORef' (w^.stamps) $ case s of
+    Pulled   -> set pullT t
+    LookedUp -> set lookT t
+    Queued   -> set queuT t
+
+-- | Finish timing the current event and reset all stamps. If the event took
+-- longer than the threshold, log a report including the state-dump created by
+-- the provided action.
+check :: HasLogFunc e
+  => Watchdog          -- ^ The 'Watchdog' environment
+  -> RIO e Utf8Builder -- ^ An action describing the current app-loop state
+  -> RIO e ()
+check (Watchdog Nothing)  _    = pure ()
+check (Watchdog (Just w)) dump = do
+  now <- liftIO getMonotonicTimeNSec
+  rcv <- atomicModifyIORef' (w^.recvAt) (0,)
+  st  <- readIORef (w^.stamps)
+  writeIORef (w^.stamps) noStamps
+  when (rcv /= 0 && now - rcv > w^.threshold) $ do
+    d  <- dump
+    gc <- liftIO gcReport
+    logWarn . mconcat $
+      [ "Slow event: took ", us rcv now, " (threshold ", us 0 (w^.threshold), ")\n"
+      , "  received -> pulled:  ", us rcv (st^.pullT), "\n"
+      , "  pulled   -> lookup:  ", us (st^.pullT) (st^.lookT), "\n"
+      , "  lookup   -> queued:  ", us (st^.lookT) (st^.queuT), "\n"
+      , "  ", d, "\n"
+      , "  ", gc
+      ]
+
+-- | Record that the emitter starts writing an event, returning the time to
+-- pass to 'written'
+writing :: MonadIO m => Watchdog -> m Word64
+writing (Watchdog Nothing)  = pure 0
+writing (Watchdog (Just _)) = liftIO getMonotonicTimeNSec
+
+-- | Record that the emitter has written and flushed the event it started
+-- writing at a time, and report if that took longer than the threshold.
+written :: HasLogFunc e => Watchdog -> Word64 -> RIO e ()
+written (Watchdog Nothing)  _ = pure ()
+written (Watchdog (Just w)) t = do
+  now <- liftIO getMonotonicTimeNSec
+  when (now - t > w^.threshold) . logWarn $
+    "Slow write: writing and flushing an event took " <> us t now
+    <> " (threshold " <> us 0 (w^.threshold) <> ")"
+
+-- | Display the time between 2 stamps in microseconds, or '-' if either stage
+-- was never reached.
+us :: Word64 -> Word64 -> Utf8Builder
+us a b
+  | b == 0 || b < a = "-"
+  | otherwise       = display ((b - a) `div` 1000) <> "us"
+
+-- | Describe the current GC statistics
+gcReport :: IO Utf8Builder
+gcReport = getRTSStatsEnabled >>= \case
+  False -> pure "GC statistics unavailable (run with +RTS -T)"
+  True  -> do
+    s <- getRTSStats
+    let g = gc s
+    pure . mconcat $
+      [ "GCs: ", display (gcs s), " (", display (major_gcs s), " major), "
+      , "last GC: generation ", display (gcdetails_gen g)
+      , " in ", display (gcdetails_elapsed_ns g `div` 1000), "us, "
+      , "live bytes: ", display (gcdetails_live_bytes g)
+      ]
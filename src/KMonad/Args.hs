@@ -15,17 +15,21 @@ where
 
 import KMonad.Prelude
 import KMonad.App
+import KMonad.App.Clock (realClock)
 import KMonad.Args.Cmd
 import KMonad.Args.Joiner
 import KMonad.Args.Parser
 import KMonad.Args.Types
+import KMonad.Trace.Analyze
 
 --------------------------------------------------------------------------------
 --
 
 -- | Run KMonad
 run :: IO ()
-run = getCmd >>= runCmd
+run = getTask >>= \case
+  Run c          -> runCmd c
+  TraceAnalyze a -> runAnalyze a
 
 -- | Execute the provided 'Cmd'
 --
@@ -36,14 +40,21 @@ runCmd :: Cmd -> IO ()
 runCmd c = do
   o <- logOptionsHandle stdout False <&> setLogMinLevel (c^.logLvl)
   withLogFunc o $ \f -> runRIO f $ do
-    cfg <- loadConfig $ c^.cfgFile
+    cfg <- loadConfig c
     unless (c^.dryRun) $ startApp cfg
 
+-- | Analyze a trace and print the report to stdout
+runAnalyze :: AnalyzeCmd -> IO ()
+runAnalyze a = runSimpleApp $ do
+  ds <- maybe (pure mempty) (fmap tapHoldDelays . loadTokens) (a^.analyzeCfg)
+  r  <- analyzeTrace ds (fromIntegral (a^.nearPct) / 100) (a^.traceIn)
+  hPutBuilder stdout $ getUtf8Builder r
+
 -- | Parse a configuration file into a 'AppCfg' record
-loadConfig :: HasLogFunc e => FilePath -> RIO e AppCfg
-loadConfig pth = do
+loadConfig :: HasLogFunc e => Cmd -> RIO e AppCfg
+loadConfig cmd = do
 
-  tks <- loadTokens pth   -- This can throw a PErrors
+  tks <- loadTokens (cmd^.cfgFile) -- This can throw a PErrors
   cgt <- joinConfigIO tks -- This can throw a JoinError
 
   -- Try loading the sink and src
@@ -53,10 +64,20 @@ loadConfig pth = do
 
   -- Assemble the AppCfg record
   pure $ AppCfg
-    { _keySinkDev   = snk
-    , _keySourceDev = src
-    , _keymapCfg    = _km    cgt
-    , _firstLayer   = _fstL  cgt
-    , _fallThrough  = _flt   cgt
-    , _allowCmd     = _allow cgt
+    { _keySinkDev    = snk
+    , _keySourceDev  = src
+    , _keymapCfg     = _km    cgt
+    , _firstLayer    = _fstL  cgt
+    , _fallThrough   = _flt   cgt
+    , _allowCmd      = _allow cgt
+    , _watchdogDelay = cmd^.watchdogMs
+    , _eventMarkers  = cmd^.evMarkers
+    , _perfCounters  = cmd^.perfCnt
+    , _idleGC        = cmd^.idleGCMs
+    , _idleWakeups   = cmd^.idleWake
+    , _heatmapFile   = cmd^.heatmapOut
+    , _traceFile     = cmd^.traceOut
+    , _tapInput      = cmd^.tapIn
+    , _tapOutput     = cmd^.tapOut
+    , _clock         = realClock
     }
@@ -10,13 +10,18 @@ Portability : non-portable (MPTC with FD, FFI to Linux-only c-code)
 
 -}
 module KMonad.Args.Cmd
-  ( Cmd(..)
+  ( Task(..)
+  , Cmd(..)
   , HasCmd(..)
-  , getCmd
+  , AnalyzeCmd(..)
+  , HasAnalyzeCmd(..)
+  , getTask
+  , idleGCP
   )
 where
 
 import KMonad.Prelude
+import KMonad.Util
 
 import Options.Applicative
 
@@ -28,16 +33,40 @@ import Options.Applicative
 
 -- | Record describing the instruction to KMonad
 data Cmd = Cmd
-  { _cfgFile :: FilePath -- ^ Which file to read the config from
-  , _dryRun  :: Bool     -- ^ Flag to indicate we are only test-parsing
-  , _logLvl  :: LogLevel -- ^ Level of logging to use
+  { _cfgFile    :: FilePath           -- ^ Which file to read the config from
+  , _dryRun     :: Bool               -- ^ Flag to indicate we are only test-parsing
+  , _logLvl     :: LogLevel           -- ^ Level of logging to use
+  , _watchdogMs :: Maybe Milliseconds -- ^ Latency above which to report events
+  , _evMarkers  :: Bool               -- ^ Whether to emit eventlog markers
+  , _perfCnt    :: Bool               -- ^ Whether to use hardware counters
+  , _idleGCMs   :: Maybe Milliseconds -- ^ Idle time after which to GC
+  , _idleWake   :: Bool               -- ^ Whether to count wakeups while idle
+  , _heatmapOut :: Maybe FilePath     -- ^ Where to write key usage counts
+  , _traceOut   :: Maybe FilePath     -- ^ Where to record the input trace
+  , _tapIn      :: Maybe FilePath     -- ^ Where to mirror input events
+  , _tapOut     :: Maybe FilePath     -- ^ Where to mirror output events
   }
   deriving Show
 makeClassy ''Cmd
 
--- | Parse 'Cmd' from the evocation of this program
-getCmd :: IO Cmd
-getCmd = customExecParser (prefs showHelpOnEmpty) $ info (cmdP <**> helper)
+-- | Record describing how to analyze a trace
+data AnalyzeCmd = AnalyzeCmd
+  { _traceIn    :: FilePath           -- ^ The trace to analyze
+  , _analyzeCfg :: Maybe FilePath     -- ^ Config to take tap-hold timeouts from
+  , _nearPct    :: Int                -- ^ How close to a timeout counts as near
+  }
+  deriving Show
+makeClassy ''AnalyzeCmd
+
+-- | The different things KMonad can be asked to do
+data Task
+  = Run Cmd                -- ^ Run KMonad with a config
+  | TraceAnalyze AnalyzeCmd -- ^ Report statistics about a recorded trace
+  deriving Show
+
+-- | Parse 'Task' from the evocation of this program
+getTask :: IO Task
+getTask = customExecParser (prefs showHelpOnEmpty) $ info (taskP <**> helper)
   (  fullDesc
   <> progDesc "Start KMonad"
   <> header   "kmonad - an onion of buttons."
@@ -49,9 +78,49 @@ getCmd = customExecParser (prefs showHelpOnEmpty) $ info (cmdP <**> helper)
 --
 -- The different command-line parsers
 
+-- | Parse either a subcommand, or the options to run KMonad with
+taskP :: Parser Task
+taskP = hsubparser traceP <|> Run <$> cmdP
+
+-- | Parse the @trace@ subcommands
+traceP :: Mod CommandFields Task
+traceP = command "trace" . info (hsubparser analyzeP) $
+  progDesc "Work with recorded input traces"
+  where
+    analyzeP = command "analyze" . info (TraceAnalyze <$> analyzeCmdP) $
+      progDesc "Report typing statistics from a trace made with --record-trace"
+
 -- | Parse the full command
 cmdP :: Parser Cmd
-cmdP = Cmd <$> fileP <*> dryrunP <*> levelP
+cmdP = Cmd <$> fileP
+           <*> dryrunP
+           <*> levelP
+           <*> watchdogP
+           <*> markersP
+           <*> perfP
+           <*> idleGCP
+           <*> idleWakeP
+           <*> heatmapP
+           <*> recordP
+           <*> tapP "input"
+           <*> tapP "output"
+
+-- | Parse the trace-analysis command
+analyzeCmdP :: Parser AnalyzeCmd
+analyzeCmdP = AnalyzeCmd
+  <$> strArgument
+    (  metavar "TRACE"
+    <> help    "The trace file to analyze")
+  <*> optional (strOption
+    (  long    "config"
+    <> short   'c'
+    <> metavar "FILE"
+    <> help    "Compare tap-hold releases to the timeouts in FILE's first layer"))
+  <*> option auto
+    (  long    "near"
+    <> metavar "PERCENT"
+    <> value   20
+    <> help    "How close to its timeout a release counts as near (default 20)")
 
 -- | Parse a filename that points us at the config-file
 fileP :: Parser FilePath
@@ -79,3 +148,73 @@ levelP = option f
     f = maybeReader $ flip lookup [ ("debug", LevelDebug), ("warn", LevelWarn)
                                   , ("info",  LevelInfo),  ("error", LevelError) ]
 
+-- | Parse the latency threshold above which slow events are reported
+watchdogP :: Parser (Maybe Milliseconds)
+watchdogP = optional $ option f
+  (  long    "watchdog"
+  <> short   'w'
+  <> metavar "MS"
+  <> help    "Report every event that takes longer than MS milliseconds to process"
+  )
+  where
+    f = eitherReader $ \s -> case readMaybe s :: Maybe Int of
+      Just n | n > 0 -> Right $ fromIntegral n
+      _              -> Left "expected a positive number of milliseconds"
+
+-- | Parse a flag that enables eventlog markers for each app-loop stage
+markersP :: Parser Bool
+markersP = switch
+  (  long    "eventlog-markers"
+  <> help    "Mark every app-loop stage in the GHC eventlog (run with +RTS -l)"
+  )
+
+-- | Parse a flag that enables hardware performance counters
+perfP :: Parser Bool
+perfP = switch
+  (  long    "perf-counters"
+  <> help    "Count cycles, instructions and cache-misses per event and report them on exit (Linux only)"
+  )
+
+-- | Parse how long to be idle before collecting garbage, 0 meaning never
+idleGCP :: Parser (Maybe Milliseconds)
+idleGCP = f <$> option auto
+  (  long    "idle-gc"
+  <> metavar "MS"
+  <> value   200
+  <> help    "Run a major GC after MS milliseconds without keys held, 0 to disable"
+  )
+  where
+    f :: Int -> Maybe Milliseconds
+    f 0 = Nothing
+    f n = Just $ fromIntegral n
+
+-- | Parse a flag that enables counting wakeups while idle
+idleWakeP :: Parser Bool
+idleWakeP = switch
+  (  long    "idle-wakeups"
+  <> help    "Count how often KMonad wakes up while idle, and log it when the idle state ends (Linux only)"
+  )
+
+-- | Parse the file to periodically write key usage counts to
+heatmapP :: Parser (Maybe FilePath)
+heatmapP = optional $ strOption
+  (  long    "heatmap"
+  <> metavar "FILE"
+  <> help    "Count presses per layer and key, and write them to FILE every minute"
+  )
+
+-- | Parse the file to record all input events to
+recordP :: Parser (Maybe FilePath)
+recordP = optional $ strOption
+  (  long    "record-trace"
+  <> metavar "FILE"
+  <> help    "Record every input event with its time to FILE, for 'kmonad trace analyze'"
+  )
+
+-- | Parse the file to mirror input or output events to
+tapP :: String -> Parser (Maybe FilePath)
+tapP n = optional $ strOption
+  (  long    ("tap-" <> n)
+  <> metavar "FILE"
+  <> help    ("Mirror every " <> n <> " event to FILE (usually a named pipe), dropping events when it is not read in time")
+  )
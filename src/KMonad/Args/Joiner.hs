@@ -241,20 +241,67 @@ getAllow = do
 
 #ifdef linux_HOST_OS
 
+-- | Extract the kernel autorepeat setting
+getRepeat :: J (Maybe (Int, Int))
+getRepeat = do
+  cfg <- oneBlock "defcfg" _KDefCfg
+  case onlyOne . extract _SKeyRepeat $ cfg of
+    Right r        -> pure $ Just r
+    Left None      -> pure Nothing
+    Left Duplicate -> throwError $ DuplicateSetting "key-repeat"
+
 -- | The Linux correspondence between IToken and actual code
 pickInput :: IToken -> J (LogFunc -> IO (Acquire KeySource))
-pickInput (KDeviceSource f)   = pure $ runLF (deviceSource64 f)
+pickInput (KDeviceSource f)   = pure $ runLF (deviceSourceNative f)
 pickInput KLowLevelHookSource = throwError $ InvalidOS "LowLevelHookSource"
 pickInput (KIOKitSource _)    = throwError $ InvalidOS "IOKitSource"
 
 -- | The Linux correspondence between OToken and actual code
 pickOutput :: OToken -> J (LogFunc -> IO (Acquire KeySink))
-pickOutput (KUinputSink t init) = pure $ runLF (uinputSink cfg)
-  where cfg = defUinputCfg { _keyboardName = T.unpack t
-                           , _postInit     = T.unpack <$> init }
+pickOutput (KUinputSink t init) = do
+  rp <- getRepeat
+  pt <- getPointer
+  let cfg = defUinputCfg { _keyboardName = T.unpack t
+                         , _postInit     = T.unpack <$> init
+                         , _keyRepeat    = rp
+                         , _emitPointer  = pt }
+  pure $ runLF (uinputSink cfg)
 pickOutput KSendEventSink       = throwError $ InvalidOS "SendEventSink"
 pickOutput KKextSink            = throwError $ InvalidOS "KextSink"
 
+-- | Whether any alias or layer uses a button that moves the pointer, in which
+-- case the uinput device has to register as a mouse as well.
+getPointer :: J Bool
+getPointer = do
+  es <- view kes
+  pure . any movesPointer $ concatMap (map snd) (extract _KDefAlias es)
+                         <> concatMap _buttons  (extract _KDefLayer es)
+  where
+    movesPointer = \case
+      KPointer _ _ _             -> True
+      KTapNext t h               -> any movesPointer [t, h]
+      KTapHold _ t h             -> any movesPointer [t, h]
+      KTapHoldNext _ t h         -> any movesPointer [t, h]
+      KTapNextRelease t h        -> any movesPointer [t, h]
+      KTapHoldNextRelease _ t h  -> any movesPointer [t, h]
+      KAroundNext b              -> movesPointer b
+      KMultiTap bs d             -> any movesPointer $ d : map snd bs
+      KAround o i                -> any movesPointer [o, i]
+      KTapMacro bs               -> any movesPointer bs
+      KComposeSeq bs             -> any movesPointer bs
+      _                          -> False
+
+#endif
+
+#ifndef linux_HOST_OS
+
+-- | Kernel autorepeat is a feature of uinput, so refuse it anywhere else rather
+-- than silently ignoring it
+noRepeat :: J ()
+noRepeat = do
+  cfg <- oneBlock "defcfg" _KDefCfg
+  unless (null $ extract _SKeyRepeat cfg) . throwError $ InvalidOS "key-repeat"
+
 #endif
 
 #ifdef mingw32_HOST_OS
@@ -267,7 +314,7 @@ pickInput (KIOKitSource _)    = throwError $ InvalidOS "IOKitSource"
 
 -- | The Windows correspondence between OToken and actual code
 pickOutput :: OToken -> J (LogFunc -> IO (Acquire KeySink))
-pickOutput KSendEventSink    = pure $ runLF sendEventKeySink
+pickOutput KSendEventSink    = noRepeat $> runLF sendEventKeySink
 pickOutput (KUinputSink _ _) = throwError $ InvalidOS "UinputSink"
 pickOutput KKextSink         = throwError $ InvalidOS "KextSink"
 
@@ -283,7 +330,7 @@ pickInput KLowLevelHookSource = throwError $ InvalidOS "LowLevelHookSource"
 
 -- | The Mac correspondence between OToken and actual code
 pickOutput :: OToken -> J (LogFunc -> IO (Acquire KeySink))
-pickOutput KKextSink            = pure $ runLF kextSink
+pickOutput KKextSink            = noRepeat $> runLF kextSink
 pickOutput (KUinputSink _ _)    = throwError $ InvalidOS "UinputSink"
 pickOutput KSendEventSink       = throwError $ InvalidOS "SendEventSink"
 
@@ -330,6 +377,7 @@ joinButton ns als =
     -- Various simple buttons
     KEmit c -> ret $ emitB c
     KCommand t -> ret $ cmdButton t
+    KPointer x d a -> ret $ pointerButton x d a
     KLayerToggle t -> if t `elem` ns
       then ret $ layerToggle t
       else throwError $ MissingLayer t
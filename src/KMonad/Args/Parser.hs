@@ -26,6 +26,7 @@ import KMonad.Prelude hiding (try, bool)
 import KMonad.Args.Types
 import KMonad.Keyboard
 import KMonad.Keyboard.ComposeSeq
+import KMonad.Keyboard.Pointer
 
 import Data.Char
 import RIO.List (sortBy, find)
@@ -258,6 +259,8 @@ buttonP = (lexeme . choice . map try $
   , statement "tap-macro"      $ KTapMacro    <$> some buttonP
   , statement "cmd-button"     $ KCommand     <$> textP
   , statement "pause"          $ KPause . fromIntegral <$> numP
+  , statement "mouse-move"     $ pointerP moveDirs   defMoveAccel
+  , statement "mouse-scroll"   $ pointerP scrollDirs defScrollAccel
   , KComposeSeq <$> deadkeySeqP
   , KRef  <$> derefP
   , lexeme $ fromNamed buttonNames
@@ -271,6 +274,21 @@ buttonP = (lexeme . choice . map try $
   where
     timed = many ((,) <$> lexeme numP <*> lexeme buttonP)
 
+    moveDirs   = [ ("up",   (MoveY, -1)),   ("down",  (MoveY, 1))
+                 , ("left", (MoveX, -1)),   ("right", (MoveX, 1)) ]
+    scrollDirs = [ ("up",   (ScrollV, 1)),  ("down",  (ScrollV, -1))
+                 , ("left", (ScrollH, -1)), ("right", (ScrollH, 1)) ]
+
+-- | Parse a direction followed by an optional start-speed, top-speed, and
+-- ramp-time for a pointer button
+pointerP :: [(Text, (Axis, Int))] -> Accel -> Parser DefButton
+pointerP ds a = do
+  (x, d) <- lexeme $ fromNamed ds
+  acc    <- option a $ Accel <$> n <*> n <*> n
+  pure $ KPointer x d acc
+  where n :: Num b => Parser b
+        n = fromIntegral <$> lexeme numP
+
 
 --------------------------------------------------------------------------------
 -- $defcfg
@@ -303,6 +321,7 @@ settingP = let f s p = symbol s *> p in
     , SInitStr     <$> f "init"        textP
     , SFallThrough <$> f "fallthrough" bool
     , SAllowCmd    <$> f "allow-cmd"   bool
+    , f "key-repeat" $ SKeyRepeat <$> lexeme numP <*> numP
     ])
 
 --------------------------------------------------------------------------------
@@ -47,6 +47,7 @@ import KMonad.Prelude
 import KMonad.Button
 import KMonad.Keyboard
 import KMonad.Keyboard.IO
+import KMonad.Keyboard.Pointer
 import KMonad.Util
 
 import Text.Megaparsec
@@ -96,6 +97,7 @@ data DefButton
   | KLayerDelay Int LayerTag               -- ^ Switch to a layer for a period of time
   | KLayerNext LayerTag                    -- ^ Perform next button in different layer
   | KCommand Text                          -- ^ Execute a shell command
+  | KPointer Axis Int Accel                -- ^ Move the pointer while held
   | KTrans                                 -- ^ Transparent button that does nothing
   | KBlock                                 -- ^ Button that catches event
   deriving Show
@@ -168,6 +170,7 @@ data DefSetting
   | SInitStr     Text
   | SFallThrough Bool
   | SAllowCmd    Bool
+  | SKeyRepeat   Int Int
   deriving Show
 makeClassyPrisms ''DefSetting
 
@@ -33,6 +33,7 @@ module KMonad.Button
   , layerRem
   , pass
   , cmdButton
+  , pointerButton
 
   -- * Button combinators
   -- $combinators
@@ -53,6 +54,7 @@ import KMonad.Prelude
 
 import KMonad.Action
 import KMonad.Keyboard
+import KMonad.Keyboard.Pointer
 import KMonad.Util
 
 
@@ -154,6 +156,13 @@ pass = onPress $ pure ()
 cmdButton :: Text -> Button
 cmdButton t = onPress $ shellCmd t
 
+-- | Create a button that moves the pointer (or scrolls) along an axis while it
+-- is held. The sign of the direction determines which way we move.
+pointerButton :: Axis -> Int -> Accel -> Button
+pointerButton x d a = mkButton
+  (myBinding >>= \c -> pointer $ StartMotion c x d a)
+  (myBinding >>= \c -> pointer $ StopMotion  c x d)
+
 --------------------------------------------------------------------------------
 -- $combinators
 --
@@ -1,4 +1,4 @@
-{-# LANGUAGE DeriveAnyClass #-}
+{-# LANGUAGE DeriveAnyClass, PatternSynonyms, ViewPatterns #-}
 {-|
 Module      : KMonad.Keyboard
 Description : Basic keyboard types
@@ -18,6 +18,7 @@ module KMonad.Keyboard
     -- $event
     Switch(..)
   , KeyEvent
+  , pattern KeyEvent
   , switch
   , keycode
   , mkKeyEvent
@@ -37,6 +38,9 @@ module KMonad.Keyboard
   , LayerTag
   , LMap
 
+    -- * Keycode count
+  , nKeycodes
+
     -- * Reexports
   , module KMonad.Keyboard.Keycode
   )
@@ -47,7 +51,12 @@ import KMonad.Prelude
 
 import KMonad.Keyboard.Keycode
 
-import qualified Data.LayerStack as Ls
+import Data.Bits ((.&.), (.|.), shiftL, shiftR)
+import RIO.Partial (toEnum)
+
+import qualified Data.LayerStack            as Ls
+import qualified RIO.Vector.Boxed           as V
+import qualified RIO.Vector.Boxed.Unsafe    as V (unsafeIndex)
 
 
 --------------------------------------------------------------------------------
@@ -65,34 +74,71 @@ data Switch
   deriving (Eq, Ord, Show, Enum, Generic, Hashable)
 
 -- | An 'KeyEvent' is a 'Switch' on a particular 'Keycode'
-data KeyEvent = KeyEvent
-  { _switch  :: Switch  -- ^ Whether the 'KeyEvent' was a 'Press' or 'Release'
-  , _keycode :: Keycode -- ^ The 'Keycode' mapped to this 'KeyEvent'
-  } deriving (Eq, Show, Generic, Hashable)
-makeLenses ''KeyEvent
+--
+-- NOTE: To keep events cheap to create and compare, a 'KeyEvent' is packed into
+-- a single machine word: the 'Switch' lives in bit 16, and the 'Keycode' in the
+-- bits below that. Use the 'KeyEvent' pattern, 'mkKeyEvent', or the 'switch'
+-- and 'keycode' lenses to work with them.
+newtype KeyEvent = PackedKeyEvent Word
+  deriving (Eq, Generic, Hashable)
+
+-- | Construct or match a 'KeyEvent' by its 'Switch' and 'Keycode'
+pattern KeyEvent :: Switch -> Keycode -> KeyEvent
+pattern KeyEvent s c <- (unpackEvent -> (s, c))
+  where KeyEvent s c = mkKeyEvent s c
+{-# COMPLETE KeyEvent #-}
+
+-- | Extract the 'Switch' and 'Keycode' from a 'KeyEvent'
+unpackEvent :: KeyEvent -> (Switch, Keycode)
+unpackEvent (PackedKeyEvent w) =
+  (toEnum . fromIntegral $ w `shiftR` 16, toEnum . fromIntegral $ w .&. 0xffff)
+{-# INLINE unpackEvent #-}
+
+-- | Whether the 'KeyEvent' was a 'Press' or 'Release'
+switch :: Lens' KeyEvent Switch
+switch = lens (fst . unpackEvent) (\e s -> mkKeyEvent s (snd $ unpackEvent e))
+
+-- | The 'Keycode' mapped to this 'KeyEvent'
+keycode :: Lens' KeyEvent Keycode
+keycode = lens (snd . unpackEvent) (\e c -> mkKeyEvent (fst $ unpackEvent e) c)
+
+instance Show KeyEvent where
+  showsPrec d e = let (s, c) = unpackEvent e in showParen (d > 10) $
+    showString "KeyEvent " . showsPrec 11 s . showString " " . showsPrec 11 c
 
 -- | A 'Display' instance for 'KeyEvent's that prints them out nicely.
 instance Display KeyEvent where
   textDisplay a = tshow (a^.switch) <> " " <> textDisplay (a^.keycode)
 
--- | An 'Ord' instance, where Press > Release, and otherwise we 'Ord' on the
--- 'Keycode'
+-- | An 'Ord' instance, where we first 'Ord' on the 'Switch' and then on the
+-- 'Keycode'. Because of how we pack events, this is just comparing 2 words.
 instance Ord KeyEvent where
-  a `compare` b = case (a^.switch) `compare` (b^.switch) of
-    EQ -> (a^.keycode) `compare` (b^.keycode)
-    x  -> x
+  PackedKeyEvent a `compare` PackedKeyEvent b = a `compare` b
+
+-- | The number of different 'Keycode's
+nKeycodes :: Int
+nKeycodes = fromEnum (maxBound :: Keycode) + 1
+
+-- | A table of all possible 'KeyEvent's, all 'Press'es first, then all
+-- 'Release's, so that creating a 'KeyEvent' only ever returns a shared value.
+eventTable :: V.Vector KeyEvent
+eventTable = V.fromList
+  [ PackedKeyEvent $ (fromIntegral (fromEnum s) `shiftL` 16) .|. fromIntegral (fromEnum c)
+  | s <- [Press, Release], c <- [minBound .. maxBound :: Keycode] ]
+{-# NOINLINE eventTable #-}
 
 -- | Create a new 'KeyEvent' from a 'Switch' and a 'Keycode'
 mkKeyEvent :: Switch -> Keycode -> KeyEvent
-mkKeyEvent = KeyEvent
+mkKeyEvent s c = V.unsafeIndex eventTable (fromEnum s * nKeycodes + fromEnum c)
+{-# INLINE mkKeyEvent #-}
 
 -- | Create a 'KeyEvent' that represents pressing a key
 mkPress :: Keycode -> KeyEvent
-mkPress = KeyEvent Press
+mkPress = mkKeyEvent Press
 
 -- | Create a 'KeyEvent' that represents releaseing a key
 mkRelease :: Keycode -> KeyEvent
-mkRelease = KeyEvent Release
+mkRelease = mkKeyEvent Release
 
 
 -- | Predicate on KeyEvent's
@@ -100,7 +146,7 @@ type KeyPred = KeyEvent -> Bool
 
 -- | Return whether the provided KeyEvent is a Press
 isPress :: KeyPred
-isPress = (== Press) . view switch
+isPress (PackedKeyEvent w) = w `shiftR` 16 == 0
 
 -- | Return whether the provided KeyEvent is a Release
 isRelease :: KeyPred
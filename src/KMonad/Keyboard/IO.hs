@@ -14,8 +14,14 @@ module KMonad.Keyboard.IO
   ( -- * KeySink: send keyboard events to the OS
     -- $snk
     KeySink
+  , SinkExtras(..)
+  , noExtras
   , mkKeySink
+  , mkExtendedKeySink
   , emitKey
+  , flushKeys
+  , moveKeys
+  , releaseKeys
 
     -- * KeySource: read keyboard events from the OS
   , KeySource
@@ -27,6 +33,7 @@ where
 import KMonad.Prelude
 
 import KMonad.Keyboard
+import KMonad.Keyboard.Pointer
 import KMonad.Util
 
 import qualified RIO.Text as T
@@ -35,7 +42,28 @@ import qualified RIO.Text as T
 -- $snk
 
 -- | A 'KeySink' sends key actions to the OS
-newtype KeySink = KeySink { emitKeyWith :: KeyEvent -> IO () }
+data KeySink = KeySink
+  { emitKeyWith :: KeyEvent -> IO () -- ^ Write 1 event
+  , flushWith   :: IO ()             -- ^ Finish a batch of written events
+  , moveWith    :: Motion -> IO ()   -- ^ Start or stop pointer motion
+  , releaseWith :: IO ()             -- ^ Release every key the sink holds
+  }
+
+-- | The optional capabilities of a 'KeySink', beyond writing events
+data SinkExtras e snk = SinkExtras
+  { flushSink   :: snk -> RIO e ()           -- ^ Action to flush the keysink
+  , moveSink    :: snk -> Motion -> RIO e () -- ^ Action to start or stop motion
+  , releaseSink :: snk -> RIO e ()           -- ^ Action to release all held keys
+  }
+
+-- | A sink that writes every event immediately, cannot move the pointer and
+-- does not keep track of which keys it holds
+noExtras :: HasLogFunc e => SinkExtras e snk
+noExtras = SinkExtras
+  { flushSink   = const $ pure ()
+  , moveSink    = \_ _ -> logWarn "Pointer motion is not supported by this KeySink"
+  , releaseSink = const $ pure ()
+  }
 
 -- | Create a new 'KeySink'
 mkKeySink :: HasLogFunc e
@@ -43,13 +71,25 @@ mkKeySink :: HasLogFunc e
   -> (snk -> RIO e ())              -- ^ Action to close the keysink
   -> (snk -> KeyEvent -> RIO e ()) -- ^ Action to write with the keysink
   -> RIO e (Acquire KeySink)
-mkKeySink o c w = do
+mkKeySink o c w = mkExtendedKeySink o c w noExtras
+
+-- | Create a new 'KeySink' with some optional capabilities. A sink that can
+-- flush may hold on to written events until the end of a batch.
+mkExtendedKeySink :: HasLogFunc e
+  => RIO e snk                      -- ^ Action to acquire the keysink
+  -> (snk -> RIO e ())              -- ^ Action to close the keysink
+  -> (snk -> KeyEvent -> RIO e ()) -- ^ Action to write with the keysink
+  -> SinkExtras e snk               -- ^ The optional capabilities
+  -> RIO e (Acquire KeySink)
+mkExtendedKeySink o c w x = do
   u     <- askUnliftIO
   let open        = unliftIO u $ logInfo "Opening KeySink" >> o
   let close snk   = unliftIO u $ logInfo "Closing KeySink" >> c snk
-  let write snk a = unliftIO u $ w snk a
+  let safely a    = unliftIO u $ a
         `catch` logRethrow "Encountered error in KeySink"
-  pure $ KeySink . write <$> mkAcquire open close
+  let mk snk      = KeySink (safely . w snk) (safely $ flushSink x snk)
+                            (safely . moveSink x snk) (safely $ releaseSink x snk)
+  pure $ mk <$> mkAcquire open close
 
 -- | Emit a key to the OS
 emitKey :: (HasLogFunc e) => KeySink -> KeyEvent -> RIO e ()
@@ -57,6 +97,21 @@ emitKey snk e = do
   logDebug $ "Emitting: " <> display e
   liftIO $ emitKeyWith snk e
 
+-- | Signal the end of a batch of emitted keys
+flushKeys :: KeySink -> RIO e ()
+flushKeys = liftIO . flushWith
+
+-- | Start or stop moving the pointer
+moveKeys :: (HasLogFunc e) => KeySink -> Motion -> RIO e ()
+moveKeys snk m = do
+  logDebug $ "Motion: " <> displayShow m
+  liftIO $ moveWith snk m
+
+-- | Release every key the sink is holding down, for example before switching
+-- to a new config. Sinks that do not track held keys do nothing.
+releaseKeys :: KeySink -> RIO e ()
+releaseKeys = liftIO . releaseWith
+
 
 --------------------------------------------------------------------------------
 -- $src
@@ -1,4 +1,4 @@
-{-# LANGUAGE DeriveAnyClass #-}
+{-# LANGUAGE DeriveAnyClass, ScopedTypeVariables, TypeApplications #-}
 {-|
 Module      : KMonad.Keyboard.IO.Linux.DeviceSource
 Description : Load and acquire a linux /dev/input device
@@ -12,22 +12,27 @@ Portability : portable
 module KMonad.Keyboard.IO.Linux.DeviceSource
   ( deviceSource
   , deviceSource64
+  , deviceSourceNative
 
   , KeyEventParser
-  , decode64
+  , nativeEventParser
+  , parser16
+  , parser24
+  , parserULong
   )
 where
 
 import KMonad.Prelude
 import Foreign.C.Types
+import Foreign.Marshal hiding (void)
+import Foreign.Ptr
+import Foreign.Storable
+import System.IO (hGetBuf)
 import System.Posix
 
 import KMonad.Keyboard.IO.Linux.Types
 import KMonad.Util
 
-import qualified Data.Serialize as B (decode)
-import qualified RIO.ByteString as B
-
 --------------------------------------------------------------------------------
 -- $err
 
@@ -35,12 +40,14 @@ data DeviceSourceError
   = IOCtlGrabError    FilePath
   | IOCtlReleaseError FilePath
   | KeyIODecodeError  String
+  | UnknownLayoutError Int
   deriving Exception
 
 instance Show DeviceSourceError where
   show (IOCtlGrabError pth)    = "Could not perform IOCTL grab on: "    <> pth
   show (IOCtlReleaseError pth) = "Could not perform IOCTL release on: " <> pth
   show (KeyIODecodeError msg)  = "KeyEvent decode failed with msg: "    <> msg
+  show (UnknownLayoutError n)  = "Unsupported input_event layout of size: " <> show n
 
 makeClassyPrisms ''DeviceSourceError
 
@@ -57,6 +64,25 @@ ioctl_keyboard :: MonadIO m
 ioctl_keyboard (Fd h) b = fromIntegral <$>
   liftIO (c_ioctl_keyboard h (if b then 1 else 0))
 
+-- | Tiny c-function that only exists to hold the @read_event@ tracepoint
+foreign import ccall unsafe "probe_read_event"
+  c_probe_read_event :: CInt -> CInt -> CInt -> CInt -> CInt -> IO ()
+
+-- | The semaphore a tracer increments while it is attached to @read_event@
+foreign import ccall "&kmonad_read_event_semaphore"
+  c_read_event_semaphore :: Ptr Word16
+
+-- | Fire the @read_event@ tracepoint for an event we just read. When nothing is
+-- tracing, this only costs reading the semaphore, not an FFI call.
+probe_read_event :: MonadIO m => LinuxKeyEvent -> m ()
+probe_read_event (LinuxKeyEvent (s, us, typ, c, val)) = liftIO $ do
+  n <- peek c_read_event_semaphore
+  when (n /= 0) $ c_probe_read_event typ c val s us
+
+-- | Ask the C-code for the layout of @struct input_event@ on this system
+foreign import ccall unsafe "input_event_layout"
+  c_input_event_layout :: Ptr CInt -> Ptr CInt -> IO CInt
+
 
 --------------------------------------------------------------------------------
 -- $decoding
@@ -66,23 +92,50 @@ ioctl_keyboard (Fd h) b = fromIntegral <$>
 data KeyEventParser = KeyEventParser
   { _nbytes :: !Int
     -- ^ Size of 1 input event in bytes
-  , _prs    :: !(B.ByteString -> Either String LinuxKeyEvent)
-    -- ^ Function to convert bytestring to event
+  , _prs    :: !(Ptr Word8 -> IO LinuxKeyEvent)
+    -- ^ Function to read an event from a buffer of '_nbytes' bytes
   }
 makeClassy ''KeyEventParser
 
--- | Default configuration for parsing keyboard events
-defEventParser :: KeyEventParser
-defEventParser = KeyEventParser 24 decode64
-
--- | The KeyEventParser that works on my 64-bit Linux environment
-decode64 :: B.ByteString -> Either String LinuxKeyEvent
-decode64 bs = (linuxKeyEvent . fliptup) <$> result
-  where
-    result :: Either String (Int32, Word16, Word16, Word64, Word64)
-    result = B.decode . B.reverse $ bs
-
-    fliptup (a, b, c, d, e) = (e, d, c, b, a)
+-- | Ask the C-code which layout @struct input_event@ has on this system and
+-- return the matching parser. This throws an 'UnknownLayoutError' if we do not
+-- know the layout.
+nativeEventParser :: MonadIO m => m KeyEventParser
+nativeEventParser = liftIO . alloca $ \sz -> alloca $ \ss -> do
+  ul <- c_input_event_layout sz ss
+  n  <- fromIntegral <$> peek sz
+  s  <- peek ss
+  case (ul, n, s) of
+    (1, 16, 4) -> pure parserULong
+    (_, 16, 4) -> pure parser16
+    (_, 24, 8) -> pure parser24
+    _          -> throwIO $ UnknownLayoutError n
+
+-- | Read the fields of an event that start at 'off', with the time-fields
+-- stored as type 't'. Since the event is read straight from the kernel, all
+-- fields are in native byte-order.
+peekEvent :: forall t. (Storable t, Integral t) => Int -> Ptr Word8 -> IO LinuxKeyEvent
+peekEvent off p = do
+  s   <- peekByteOff p 0                :: IO t
+  us  <- peekByteOff p (sizeOf s)       :: IO t
+  typ <- peekByteOff p off              :: IO Word16
+  c   <- peekByteOff p (off + 2)        :: IO Word16
+  val <- peekByteOff p (off + 4)        :: IO Int32
+  pure $ linuxKeyEvent (s, us, typ, c, val)
+
+-- | The 16 byte layout with a 32-bit @struct timeval@, used by 32-bit
+-- userspace with a 32-bit @time_t@.
+parser16 :: KeyEventParser
+parser16 = KeyEventParser 16 (peekEvent @Int32 8)
+
+-- | The 24 byte layout with a 64-bit @struct timeval@, used on 64-bit Linux.
+parser24 :: KeyEventParser
+parser24 = KeyEventParser 24 (peekEvent @Int64 16)
+
+-- | The 16 byte layout where the time is stored as 2 unsigned 32-bit
+-- @__kernel_ulong_t@ fields, used by 32-bit userspace with a 64-bit @time_t@.
+parserULong :: KeyEventParser
+parserULong = KeyEventParser 16 (peekEvent @Word32 8)
 
 
 --------------------------------------------------------------------------------
@@ -100,6 +153,7 @@ data DeviceFile = DeviceFile
   { _cfg :: !DeviceSourceCfg -- ^ Configuration settings
   , _fd  :: !Fd              -- ^ Posix filedescriptor to the device file
   , _hdl :: !Handle          -- ^ Haskell handle to the device file
+  , _buf :: !(Ptr Word8)      -- ^ Buffer to read 1 event into
   }
 makeClassy ''DeviceFile
 
@@ -117,7 +171,16 @@ deviceSource pr pt = mkKeySource (lsOpen pr pt) lsClose lsRead
 deviceSource64 :: HasLogFunc e
   => FilePath  -- ^ The filepath to the device file
   -> RIO e (Acquire KeySource)
-deviceSource64 = deviceSource defEventParser
+deviceSource64 = deviceSource parser24
+
+-- | Open a device file, decoding events with the layout of this system
+deviceSourceNative :: HasLogFunc e
+  => FilePath  -- ^ The filepath to the device file
+  -> RIO e (Acquire KeySource)
+deviceSourceNative pt = do
+  pr <- nativeEventParser
+  logDebug $ "Decoding " <> display (pr^.nbytes) <> " byte input events"
+  deviceSource pr pt
 
 
 --------------------------------------------------------------------------------
@@ -136,7 +199,8 @@ lsOpen pr pt = do
   hd <- liftIO $ fdToHandle h
   logInfo $ "Initiating ioctl grab"
   ioctl_keyboard h True `onErr` IOCtlGrabError pt
-  return $ DeviceFile (DeviceSourceCfg pt pr) h hd
+  bf <- liftIO . mallocBytes $ pr^.nbytes
+  return $ DeviceFile (DeviceSourceCfg pt pr) h hd bf
 
 -- | Release the ioctl grab and close the device file. This can throw an
 -- 'IOException' if the handle to the device cannot be properly closed, or an
@@ -146,15 +210,18 @@ lsClose src = do
   logInfo $ "Releasing ioctl grab"
   ioctl_keyboard (src^.fd) False `onErr` IOCtlReleaseError (src^.pth)
   liftIO . closeFd $ src^.fd
+  liftIO . free $ src^.buf
 
--- | Read a bytestring from an open filehandle and return a parsed event. This
--- can throw a 'KeyIODecodeError' if reading from the 'DeviceFile' fails to
--- yield a parseable sequence of bytes.
+-- | Read 1 event from an open filehandle and return it parsed. This can throw
+-- a 'KeyIODecodeError' if reading from the 'DeviceFile' yields less than 1
+-- complete event.
 lsRead :: (HasLogFunc e) => DeviceFile -> RIO e KeyEvent
 lsRead src = do
-  bts <- B.hGet (src^.hdl) (src^.nbytes)
-  case (src^.prs $ bts) of
-    Right p -> case fromLinuxKeyEvent p of
-      Just e  -> return e
-      Nothing -> lsRead src
-    Left s -> throwIO $ KeyIODecodeError s
+  n <- liftIO $ hGetBuf (src^.hdl) (src^.buf) (src^.nbytes)
+  when (n /= src^.nbytes) . throwIO . KeyIODecodeError $
+    "read " <> show n <> " of " <> show (src^.nbytes) <> " bytes"
+  p <- liftIO $ (src^.prs) (src^.buf)
+  probe_read_event p
+  case fromLinuxKeyEvent p of
+    Just e  -> return e
+    Nothing -> lsRead src
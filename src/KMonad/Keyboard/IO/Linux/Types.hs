@@ -15,6 +15,7 @@ module KMonad.Keyboard.IO.Linux.Types
     LinuxKeyEvent(..)
   , linuxKeyEvent
   , sync
+  , relEvent
 
     -- * Casting between 'KeyEvent' and 'LinuxKeyEvent'
     -- $linuxev
@@ -35,6 +36,7 @@ import RIO.Partial (toEnum)
 
 import KMonad.Keyboard
 import KMonad.Keyboard.IO
+import KMonad.Keyboard.Pointer
 import KMonad.Util
 
 
@@ -80,6 +82,16 @@ linuxKeyEvent (a, b, c, d, e) = LinuxKeyEvent (f a, f b, f c, f d, f e)
 sync :: SystemTime -> LinuxKeyEvent
 sync (MkSystemTime s ns) = LinuxKeyEvent (fi s, fi ns, 0, 0, 0)
 
+-- | Constructor for linux relative motion events (type 2), moving a number of
+-- units along an 'Axis'.
+relEvent :: Axis -> Int -> SystemTime -> LinuxKeyEvent
+relEvent x v (MkSystemTime s ns) = LinuxKeyEvent (fi s, fi ns, 2, c, fi v)
+  where c = case x of
+          MoveX   -> 0 -- REL_X
+          MoveY   -> 1 -- REL_Y
+          ScrollH -> 6 -- REL_HWHEEL
+          ScrollV -> 8 -- REL_WHEEL
+
 
 -------------------------------------------------------------------------------
 -- $linuxev
@@ -16,6 +16,8 @@ module KMonad.Keyboard.IO.Linux.UinputSink
   , productCode
   , productVersion
   , postInit
+  , keyRepeat
+  , emitPointer
   , uinputSink
   , defUinputCfg
   )
@@ -25,15 +27,27 @@ import KMonad.Prelude
 
 import Data.Time.Clock.System (getSystemTime)
 
+import Control.Concurrent (rtsSupportsBoundThreads, threadWaitRead, threadWaitWrite)
+import Data.Bits (clearBit, setBit, shiftR, testBit, (.&.))
 import Foreign.C.String
 import Foreign.C.Types
+import Foreign.ForeignPtr
+import Foreign.Ptr (Ptr)
+import Foreign.Marshal.Alloc (alloca)
+import Foreign.Marshal.Array (pokeArray, withArrayLen)
+import Foreign.Storable (peekElemOff, poke, pokeElemOff)
+import GHC.Clock (getMonotonicTimeNSec)
 import System.Posix
 import UnliftIO.Async   (async)
-import UnliftIO.Process (callCommand)
+import UnliftIO.Process (callCommand, getProcessExitCode, spawnCommand)
+import RIO.Partial (toEnum)
 
 import KMonad.Keyboard.IO.Linux.Types
+import KMonad.Keyboard.Pointer
 import KMonad.Util
 
+import qualified RIO.Map as M
+
 --------------------------------------------------------------------------------
 -- $err
 
@@ -44,6 +58,8 @@ data UinputSinkError
   = UinputRegistrationError SinkId               -- ^ Could not register device
   | UinputReleaseError      SinkId               -- ^ Could not release device
   | SinkEncodeError         SinkId LinuxKeyEvent -- ^ Could not decode event
+  | UinputWriteError        SinkId               -- ^ Could not write events
+  | MotionTimerError        SinkId               -- ^ Could not use the timerfd
   deriving Exception
 
 instance Show UinputSinkError where
@@ -55,6 +71,8 @@ instance Show UinputSinkError where
     , "to bytes for writing to"
     , snk
     ]
+  show (UinputWriteError snk) = "Could not write events to: " <> snk
+  show (MotionTimerError snk) = "Could not set up motion timer for: " <> snk
 
 makeClassyPrisms ''UinputSinkError
 
@@ -69,6 +87,8 @@ data UinputCfg = UinputCfg
   , _productVersion :: !CInt
   , _keyboardName   :: !String
   , _postInit       :: !(Maybe String)
+  , _keyRepeat      :: !(Maybe (Int, Int)) -- ^ Kernel autorepeat delay (ms) and rate (Hz)
+  , _emitPointer    :: !Bool               -- ^ Whether to also act as a mouse
   } deriving (Eq, Show)
 makeClassy ''UinputCfg
 
@@ -80,18 +100,35 @@ defUinputCfg = UinputCfg
   , _productVersion = 0x0000
   , _keyboardName   = "KMonad simulated keyboard"
   , _postInit       = Nothing
+  , _keyRepeat      = Nothing
+  , _emitPointer    = False
   }
 
+-- | The motions that are currently active, by the key that started them, with
+-- the monotonic time in nanoseconds at which they started.
+type Motions = M.Map (Keycode, Axis, Int) (Word64, Accel)
+
 -- | UinputSink is an MVar to a filehandle
 data UinputSink = UinputSink
-  { _cfg     :: UinputCfg
-  , _st      :: MVar Fd
+  { _cfg       :: UinputCfg
+  , _st        :: MVar Fd
+  , _timer     :: Fd                    -- ^ The timerfd that paces pointer motion
+  , _motions   :: TVar Motions          -- ^ The currently active pointer motions
+  , _mover     :: MVar (Async ())       -- ^ The thread emitting pointer motion
+  , _down      :: ForeignPtr Word64     -- ^ 1 bit per keycode, set while pressed
+  , _redundant :: IORef Int             -- ^ Transitions we did not emit
+  , _queue     :: IORef [LinuxKeyEvent] -- ^ Events waiting for a flush, newest first
+  , _stalls    :: IORef Int             -- ^ Times the device was not ready for writes
   }
 makeLenses ''UinputSink
 
 -- | Return a new uinput 'KeySink' with extra options
 uinputSink :: HasLogFunc e => UinputCfg -> RIO e (Acquire KeySink)
-uinputSink c = mkKeySink (usOpen c) usClose usWrite
+uinputSink c = mkExtendedKeySink (usOpen c) usClose usWrite
+  noExtras { flushSink   = usFlush
+           , moveSink    = usMotion
+           , releaseSink = usReleaseAll
+           }
 
 --------------------------------------------------------------------------------
 -- FFI calls and type-friendly wrappers
@@ -103,34 +140,66 @@ foreign import ccall "acquire_uinput_keysink"
     -> CInt    -- ^ Vendor ID
     -> CInt    -- ^ Product ID
     -> CInt    -- ^ Version ID
+    -> CInt    -- ^ Autorepeat delay in ms, 0 to disable autorepeat
+    -> CInt    -- ^ Autorepeat period in ms
+    -> CInt    -- ^ 1 to also register as a pointer, 0 otherwise
     -> IO Int
 
 foreign import ccall "release_uinput_keysink"
   c_release_uinput_keysink :: CInt -> IO Int
 
-foreign import ccall "send_event"
-  c_send_event :: CInt -> CInt -> CInt -> CInt -> CInt -> CInt -> IO Int
+foreign import ccall unsafe "send_events"
+  c_send_events :: CInt -> Ptr CInt -> CInt -> Ptr CInt -> IO CInt
+
+foreign import ccall unsafe "motion_timer_open"
+  c_motion_timer_open :: IO CInt
+
+foreign import ccall unsafe "motion_timer_set"
+  c_motion_timer_set :: CInt -> CLong -> IO CInt
+
+foreign import ccall unsafe "motion_timer_read"
+  c_motion_timer_read :: CInt -> IO CLLong
 
 -- | Create and acquire a Uinput device
 acquire_uinput_keysink :: MonadIO m => Fd -> UinputCfg -> m Int
 acquire_uinput_keysink (Fd h) c = liftIO $ do
   cstr <- newCString $ c^.keyboardName
+  let (d, r) = fromMaybe (0, 1) $ c^.keyRepeat
   c_acquire_uinput_keysink h cstr
     (c^.vendorCode) (c^.productCode) (c^.productVersion)
+    (fromIntegral d) (fromIntegral $ 1000 `div` max 1 r)
+    (bool 0 1 $ c^.emitPointer)
 
 -- | Release a Uinput device
 release_uinput_keysink :: MonadIO m => Fd -> m Int
 release_uinput_keysink (Fd h) = liftIO $ c_release_uinput_keysink h
 
--- | Using a Uinput device, send a LinuxKeyEvent to the Linux kernel
-send_event :: ()
+-- | Using a Uinput device, send a number of LinuxKeyEvents to the Linux kernel
+-- in a single write. Whenever the device is not ready we wait for it through
+-- the runtime, so that no OS thread is ever blocked on it.
+send_events :: ()
   => UinputSink
   -> Fd
-  -> LinuxKeyEvent
+  -> [LinuxKeyEvent]
   -> RIO e ()
-send_event u (Fd h) e@(LinuxKeyEvent (s', ns', typ, c, val)) = do
-  (liftIO $ c_send_event h typ c val s' ns')
-    `onErr` SinkEncodeError (u^.cfg.keyboardName) e
+send_events _ _ [] = pure ()
+send_events u fd@(Fd h) es = liftIO .
+  withArrayLen (concatMap flat es) $ \l p -> alloca $ \off -> do
+    poke off 0
+    let go = c_send_events h p (fromIntegral $ l `div` 5) off >>= \case
+          0 -> pure ()
+          1 -> do
+            modifyIORef' (u^.stalls) (+1)
+            threadWaitWrite fd
+            go
+          _ -> throwIO $ UinputWriteError (u^.cfg.keyboardName)
+    go
+  where flat (LinuxKeyEvent (s', ns', typ, c, val)) = [typ, c, val, s', ns']
+
+-- | Set the period of a motion timer in nanoseconds, 0 to disarm it
+motion_timer_set :: MonadIO m => Fd -> Int -> m Int
+motion_timer_set (Fd h) ns = fromIntegral <$>
+  liftIO (c_motion_timer_set h (fromIntegral ns))
 
 
 --------------------------------------------------------------------------------
@@ -144,12 +213,41 @@ usOpen c = do
   acquire_uinput_keysink fd c `onErr` UinputRegistrationError (c ^. keyboardName)
   flip (maybe $ pure ()) (c^.postInit) $ \cmd -> do
     logInfo $ "Running UinputSink command: " <> displayShow cmd
-    void . async . callCommand $ cmd
-  UinputSink c <$> newMVar fd
+    void . async $ runPostInit cmd
+  tfd <- liftIO c_motion_timer_open
+  when (tfd < 0) . throwIO $ MotionTimerError (c^.keyboardName)
+  bm  <- liftIO $ mallocForeignPtrArray bitmapWords
+  liftIO . withForeignPtr bm $ \p -> pokeArray p (replicate bitmapWords 0)
+  snk <- UinputSink c <$> newMVar fd <*> pure (Fd tfd)
+                      <*> newTVarIO M.empty <*> newEmptyMVar
+                      <*> pure bm <*> newIORef 0 <*> newIORef [] <*> newIORef 0
+  async (moveLoop snk) >>= putMVar (snk^.mover)
+  pure snk
+
+-- | Run a shell command to completion. Without the threaded runtime, waiting on
+-- a process would block every thread, so there we poll for it to finish.
+runPostInit :: MonadIO m => String -> m ()
+runPostInit cmd
+  | rtsSupportsBoundThreads = callCommand cmd
+  | otherwise = spawnCommand cmd >>= wait
+  where wait p = getProcessExitCode p >>= \case
+          Nothing -> threadDelay 100000 >> wait p
+          Just _  -> pure ()
 
 -- | Close a 'UinputSink'
 usClose :: HasLogFunc e => UinputSink -> RIO e ()
-usClose snk = withMVar (snk^.st) $ \h -> finally (release h) (close h)
+usClose snk = do
+  readMVar (snk^.mover) >>= cancel
+  liftIO . closeFd $ snk^.timer
+  -- Never leave keys stuck down in whatever gets focus after us
+  usReleaseAll snk
+  n <- readIORef $ snk^.redundant
+  when (n > 0) . logInfo $
+    "Dropped " <> display n <> " redundant key events while running"
+  w <- readIORef $ snk^.stalls
+  when (w > 0) . logInfo $
+    "Waited " <> display w <> " times for the uinput device to accept writes"
+  withMVar (snk^.st) $ \h -> finally (release h) (close h)
   where
     release h = do
       logInfo $ "Unregistering Uinput device"
@@ -160,10 +258,126 @@ usClose snk = withMVar (snk^.st) $ \h -> finally (release h) (close h)
       logInfo $ "Closing Uinput device file"
       liftIO $ closeFd h
 
--- | Write a keyboard event to the sink and sync the driver state. Using an MVar
--- ensures that we can never have 2 threads try to write at the same time.
+-- | Queue a keyboard event, followed by a sync of the driver state, to be
+-- written on the next flush. Using an MVar ensures that we can never have 2
+-- threads try to write at the same time.
+--
+-- Events that would not change the state of the key (pressing a key that is
+-- already down, or releasing one that is already up) are dropped and counted
+-- instead, since the kernel would only ignore them anyway.
 usWrite :: HasLogFunc e => UinputSink -> KeyEvent -> RIO e ()
-usWrite u e = withMVar (u^.st) $ \fd -> do
+usWrite u e = withMVar (u^.st) $ \_ -> liftIO (transition u e) >>= \case
+  False -> do
+    modifyIORef' (u^.redundant) (+1)
+    logDebug $ "Dropping redundant event: " <> display e
+  True  -> do
+    now <- liftIO $ getSystemTime
+    modifyIORef' (u^.queue) ([sync now, toLinuxKeyEvent e now] <>)
+
+-- | Write every queued event to the device, in a single write call
+usFlush :: HasLogFunc e => UinputSink -> RIO e ()
+usFlush u = withMVar (u^.st) $ \fd -> writeOut u fd []
+
+-- | Write everything that is queued, followed by some more events. Must be
+-- called while holding the MVar.
+writeOut :: UinputSink -> Fd -> [LinuxKeyEvent] -> RIO e ()
+writeOut u fd es = do
+  q <- atomicModifyIORef' (u^.queue) ([],)
+  send_events u fd $ reverse q <> es
+
+-- | Release every key that is currently held, with a single sync at the end.
+-- This happens when the sink closes, and through 'releaseKeys' whenever
+-- KMonad wants to start over from a clean slate.
+usReleaseAll :: HasLogFunc e => UinputSink -> RIO e ()
+usReleaseAll u = withMVar (u^.st) $ \fd -> do
+  cs <- liftIO . withForeignPtr (u^.down) $ \p ->
+    fmap concat . for [0 .. bitmapWords - 1] $ \i -> do
+      w <- peekElemOff p i
+      pokeElemOff p i 0
+      pure [ toEnum (64 * i + b) | b <- [0..63], testBit w b ]
+  now <- liftIO $ getSystemTime
+  unless (null cs) . logInfo $ "Releasing " <> display (length cs) <> " held keys"
+  writeOut u fd $ if null cs then [] else
+    map (flip toLinuxKeyEvent now . mkRelease) cs <> [sync now]
+
+
+--------------------------------------------------------------------------------
+-- $state
+--
+-- The sink keeps a bitmap of which keys it has pressed, so that it can tell in
+-- constant time whether an event changes anything, and release everything it
+-- holds when it closes.
+
+-- | The number of 64-bit words needed for 1 bit per 'Keycode'
+bitmapWords :: Int
+bitmapWords = fromEnum (maxBound :: Keycode) `div` 64 + 1
+
+-- | Apply an event to the bitmap, returning whether it changed the state of
+-- its key.
+transition :: UinputSink -> KeyEvent -> IO Bool
+transition u e = withForeignPtr (u^.down) $ \p -> do
+  let c = fromEnum $ e^.keycode
+      i = c `shiftR` 6
+      b = c .&. 63
+  w <- peekElemOff p i
+  let w' = if isPress e then setBit w b else clearBit w b
+  pokeElemOff p i w'
+  pure $ w' /= w
+
+
+--------------------------------------------------------------------------------
+-- $motion
+--
+-- Pointer motion is emitted by a separate thread that sleeps until a motion is
+-- started, and then wakes up on every expiration of a 1 kHz timerfd to emit
+-- the distance covered since the last tick. When the last motion stops, the
+-- timer is disarmed again, so an idle pointer costs no wakeups.
+
+-- | The period of the motion timer in nanoseconds
+motionPeriod :: Int
+motionPeriod = 1000000
+
+-- | Start or stop a motion
+usMotion :: HasLogFunc e => UinputSink -> Motion -> RIO e ()
+usMotion u m = do
+  now <- liftIO getMonotonicTimeNSec
+  atomically . modifyTVar' (u^.motions) $ case m of
+    StartMotion c x d a -> M.insert (c, x, signum d) (now, a)
+    StopMotion  c x d   -> M.delete (c, x, signum d)
+
+-- | Emit pointer motion for as long as any motion is active. Fractions of units
+-- are carried over between ticks, so that slow speeds still move smoothly.
+moveLoop :: HasLogFunc e => UinputSink -> RIO e ()
+moveLoop u = forever $ do
+  atomically $ readTVar (u^.motions) >>= checkSTM . not . M.null
+  motion_timer_set (u^.timer) motionPeriod
+    `onErr` MotionTimerError (u^.cfg.keyboardName)
+  go M.empty
+  where
+    go carry = do
+      liftIO . threadWaitRead $ u^.timer
+      let Fd h = u^.timer
+      n  <- liftIO $ c_motion_timer_read h
+      ms <- readTVarIO $ u^.motions
+      now <- liftIO getMonotonicTimeNSec
+      if | n < 0     -> throwIO $ MotionTimerError (u^.cfg.keyboardName)
+         | M.null ms -> void $ motion_timer_set (u^.timer) 0
+         | n == 0    -> go carry
+         | otherwise -> do
+             let dt   = fromIntegral n * fromIntegral motionPeriod / 1e9
+                 want = M.fromListWith (+)
+                   [ (x, fromIntegral d * speedAt a (now - t0) * dt)
+                   | ((_, x, d), (t0, a)) <- M.toList ms ]
+                 -- Only carry fractions for axes that are still moving
+                 tot  = M.unionWith (+) want $ M.intersection carry want
+                 step = M.map truncate tot :: M.Map Axis Int
+             usMove u . M.toList $ M.filter (/= 0) step
+             go $ M.unionWith (-) tot (fromIntegral <$> step)
+
+-- | Write a number of relative motion events to the sink and sync the driver
+-- state once.
+usMove :: HasLogFunc e => UinputSink -> [(Axis, Int)] -> RIO e ()
+usMove _ [] = pure ()
+usMove u vs = withMVar (u^.st) $ \fd -> do
   now <- liftIO $ getSystemTime
-  send_event u fd . toLinuxKeyEvent e $ now
-  send_event u fd . sync              $ now
+  writeOut u fd $ map (\(x, v) -> relEvent x v now) vs <> [sync now]
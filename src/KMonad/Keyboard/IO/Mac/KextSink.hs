@@ -16,13 +16,16 @@ import KMonad.Keyboard.IO.Mac.Types
 foreign import ccall "send_key"
   send_key :: Ptr MacKeyEvent -> IO ()
 
+foreign import ccall "flush_keys"
+  flush_keys :: IO ()
+
 data EvBuf = EvBuf
   { _buffer :: Ptr MacKeyEvent -- ^ The pointer we write events to
   }
 makeClassy ''EvBuf
 
 kextSink :: HasLogFunc e => RIO e (Acquire KeySink)
-kextSink = mkKeySink skOpen skClose skSend
+kextSink = mkExtendedKeySink skOpen skClose skSend noExtras { flushSink = skFlush }
 
 -- | Create the 'EvBuf' environment
 skOpen :: HasLogFunc e => RIO e EvBuf
@@ -36,7 +39,7 @@ skClose sk = do
   logInfo "Closing Mac key sink"
   liftIO . free $ sk^.buffer
 
--- | Write an event to the pointer and prompt windows to inject it
+-- | Write an event to the pointer and record it in the pending HID reports
 --
 -- NOTE: This can throw an error if event-conversion fails.
 skSend :: HasLogFunc e => EvBuf -> KeyEvent -> RIO e ()
@@ -44,3 +47,7 @@ skSend sk e = either throwIO go $ toMacKeyEvent e
   where go e' = liftIO $ do
           poke (sk^.buffer) e'
           send_key $ sk^.buffer
+
+-- | Post the HID reports for all events written since the last flush
+skFlush :: HasLogFunc e => EvBuf -> RIO e ()
+skFlush _ = liftIO flush_keys
@@ -0,0 +1,37 @@
+{-|
+Module      : KMonad.Keyboard.IO.Memory
+Description : KeySources and KeySinks backed by in-memory queues
+Copyright   : (c) David Janssen, 2019
+License     : MIT
+Maintainer  : janssen.dhj@gmail.com
+Stability   : experimental
+Portability : portable
+
+A 'KeySource' and 'KeySink' that do not talk to the OS at all, but simply read
+from and write to 'TQueue's. This makes it possible to drive the full app-loop
+with synthetic events, which is useful for running long-lived or high-rate
+workloads through KMonad without a physical keyboard.
+
+-}
+module KMonad.Keyboard.IO.Memory
+  ( memSource
+  , memSink
+  )
+where
+
+import KMonad.Prelude
+
+import KMonad.Keyboard
+import KMonad.Keyboard.IO
+
+-- | Return a 'KeySource' that reads its events from a 'TQueue'
+memSource :: HasLogFunc e
+  => TQueue KeyEvent -- ^ The queue to read events from
+  -> RIO e (Acquire KeySource)
+memSource q = mkKeySource (pure q) (const $ pure ()) (atomically . readTQueue)
+
+-- | Return a 'KeySink' that writes its events to a 'TQueue'
+memSink :: HasLogFunc e
+  => TQueue KeyEvent -- ^ The queue to write events to
+  -> RIO e (Acquire KeySink)
+memSink q = mkKeySink (pure q) (const $ pure ()) (\q' -> atomically . writeTQueue q')
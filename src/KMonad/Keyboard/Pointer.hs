@@ -0,0 +1,84 @@
+{-|
+Module      : KMonad.Keyboard.Pointer
+Description : Pointer motion and scrolling driven by held buttons
+Copyright   : (c) David Janssen, 2019
+License     : MIT
+Maintainer  : janssen.dhj@gmail.com
+Stability   : experimental
+Portability : portable
+
+Mouse-keys are buttons that move the pointer or scroll while they are held. A
+button does not emit any motion itself, it only tells the 'KMonad.Keyboard.IO.KeySink'
+to start or stop moving along an 'Axis'. The sink then emits steady motion at
+a speed described by an 'Accel' curve, for as long as the motion is active.
+
+-}
+module KMonad.Keyboard.Pointer
+  ( -- * Types
+    -- $types
+    Axis(..)
+  , Accel(..)
+  , HasAccel(..)
+  , Motion(..)
+  , defMoveAccel
+  , defScrollAccel
+
+    -- * Curves
+    -- $curves
+  , speedAt
+  )
+where
+
+import KMonad.Prelude
+
+import KMonad.Keyboard.Keycode
+import KMonad.Util
+
+--------------------------------------------------------------------------------
+-- $types
+
+-- | The directions along which we can move
+data Axis
+  = MoveX   -- ^ Move the pointer horizontally, positive is right
+  | MoveY   -- ^ Move the pointer vertically, positive is down
+  | ScrollV -- ^ Scroll vertically, positive is up
+  | ScrollH -- ^ Scroll horizontally, positive is right
+  deriving (Eq, Ord, Show, Enum, Bounded)
+
+-- | How the speed of a motion develops while it is held
+data Accel = Accel
+  { _startSpeed :: !Double       -- ^ Units per second when starting
+  , _topSpeed   :: !Double       -- ^ Units per second once fully accelerated
+  , _rampTime   :: !Milliseconds -- ^ Time to go from start to top speed
+  } deriving (Eq, Show)
+makeClassy ''Accel
+
+-- | A request to the sink to start or stop moving along an 'Axis'. Motions are
+-- identified by the key of the button that started them, and their axis and
+-- direction. So 2 buttons moving the same way each add their own speed, and
+-- releasing 1 of them leaves the other moving.
+data Motion
+  = StartMotion Keycode Axis Int Accel -- ^ Start moving in the direction of the sign
+  | StopMotion  Keycode Axis Int       -- ^ Stop moving in the direction of the sign
+  deriving (Eq, Show)
+
+-- | Default acceleration for pointer movement, in pixels
+defMoveAccel :: Accel
+defMoveAccel = Accel 100 1200 600
+
+-- | Default acceleration for scrolling, in wheel-detents
+defScrollAccel :: Accel
+defScrollAccel = Accel 5 25 1000
+
+
+--------------------------------------------------------------------------------
+-- $curves
+
+-- | The speed (in units per second) of a motion that has been active for a
+-- number of nanoseconds. The speed rises quadratically, which gives fine
+-- control for short presses while still crossing the screen quickly.
+speedAt :: Accel -> Word64 -> Double
+speedAt a ns = a^.startSpeed + (a^.topSpeed - a^.startSpeed) * r * r
+  where
+    ramp = 1000000 * fromIntegral (a^.rampTime)
+    r    = if ramp <= 0 then 1 else min 1 (fromIntegral ns / ramp)
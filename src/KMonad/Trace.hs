@@ -0,0 +1,155 @@
+{-# LANGUAGE BangPatterns, DeriveAnyClass #-}
+{-|
+Module      : KMonad.Trace
+Description : Recording and reading traces of input events
+Copyright   : (c) David Janssen, 2019
+License     : MIT
+Maintainer  : janssen.dhj@gmail.com
+Stability   : experimental
+Portability : portable
+
+A trace is a record of every 'KeyEvent' KMonad received from the OS, along with
+when it arrived. Traces are plain text, with 1 event per line:
+
+> <microseconds>\t<p|r>\t<keycode>
+
+where the time is measured from the start of the recording, @p@ and @r@ stand
+for press and release, and the keycode is the numeric Linux keycode. Lines that
+start with a @#@ are comments.
+
+Traces can get very large, so they are never read into memory as a whole: they
+are consumed with a strict left fold over the lines of the file.
+
+-}
+module KMonad.Trace
+  ( -- * Trace events
+    TraceEvent(..)
+  , HasTraceEvent(..)
+  , TraceError(..)
+
+    -- * Recording
+  , Recorder
+  , mkRecorder
+  , record
+  , writeEvent
+  , traceHeader
+
+    -- * Reading
+  , foldTrace
+  , foldTraceM
+  )
+where
+
+import KMonad.Prelude
+
+import GHC.Clock (getMonotonicTimeNSec)
+import RIO.Partial (toEnum)
+
+import KMonad.Keyboard
+
+import qualified RIO.ByteString as B
+
+--------------------------------------------------------------------------------
+-- $types
+
+-- | A 'KeyEvent' along with when it happened
+data TraceEvent = TraceEvent
+  { _tTime  :: !Word64   -- ^ Microseconds since the start of the trace
+  , _tEvent :: !KeyEvent -- ^ The event that happened
+  } deriving (Eq, Show)
+makeClassy ''TraceEvent
+
+-- | The things that can go wrong reading a trace
+data TraceError = TraceParseError FilePath Int
+  deriving Exception
+
+instance Show TraceError where
+  show (TraceParseError f n) = "Could not parse line " <> show n <> " of trace: " <> f
+
+
+--------------------------------------------------------------------------------
+-- $rec
+
+-- | A handle to write a trace to, and the time at which the recording started.
+-- 'Nothing' when disabled.
+newtype Recorder = Recorder (Maybe (Handle, Word64))
+
+-- | Create a 'Recorder' in a 'ContT' environment. The file is only flushed
+-- when its buffer is full and when the continuation finishes, so recording
+-- costs no system-call per event.
+mkRecorder :: HasLogFunc e => Maybe FilePath -> ContT r (RIO e) Recorder
+mkRecorder Nothing  = pure $ Recorder Nothing
+mkRecorder (Just f) = ContT $ \next -> withBinaryFile f WriteMode $ \h -> do
+  logInfo $ "Recording input trace to: " <> fromString f
+  hSetBuffering h $ BlockBuffering Nothing
+  B.hPut h traceHeader
+  t <- liftIO getMonotonicTimeNSec
+  next . Recorder $ Just (h, t)
+
+-- | Write an event to the trace
+record :: MonadIO m => Recorder -> KeyEvent -> m ()
+record (Recorder Nothing)       _ = pure ()
+record (Recorder (Just (h, t))) e = do
+  now <- liftIO getMonotonicTimeNSec
+  writeEvent h $ TraceEvent ((now - t) `div` 1000) e
+
+-- | Write 1 line of a trace to a 'Handle'
+writeEvent :: MonadIO m => Handle -> TraceEvent -> m ()
+writeEvent h (TraceEvent t e) = hPutBuilder h . getUtf8Builder . mconcat $
+  [ display t, "\t"
+  , if isPress e then "p" else "r", "\t"
+  , display (fromEnum $ e^.keycode), "\n"
+  ]
+
+
+-- | The comment at the top of every trace we write
+traceHeader :: ByteString
+traceHeader = "# kmonad input trace: <microseconds> <p|r> <keycode>\n"
+
+
+--------------------------------------------------------------------------------
+-- $read
+
+-- | Strictly fold over all the events in a trace. This throws a
+-- 'TraceParseError' on the first line that cannot be parsed.
+foldTrace :: MonadUnliftIO m
+  => FilePath               -- ^ The trace to read
+  -> (s -> TraceEvent -> s) -- ^ The function to fold with
+  -> s                      -- ^ The initial state
+  -> m s
+foldTrace f step = foldTraceM f (\s -> pure . step s)
+
+-- | Like 'foldTrace', but with a monadic step
+foldTraceM :: MonadUnliftIO m
+  => FilePath                  -- ^ The trace to read
+  -> (s -> TraceEvent -> m s)  -- ^ The action to fold with
+  -> s                         -- ^ The initial state
+  -> m s
+foldTraceM f step s0 = withBinaryFile f ReadMode $ \h -> go h 1 s0
+  where
+    go h !n !s = hIsEOF h >>= \case
+      True  -> pure s
+      False -> do
+        l <- liftIO $ B.hGetLine h
+        if B.null l || B.head l == 35 -- '#'
+          then go h (n + 1) s
+          else case parseLine l of
+            Nothing -> throwIO $ TraceParseError f n
+            Just e  -> step s e >>= go h (n + 1)
+
+-- | Parse 1 line of a trace
+parseLine :: ByteString -> Maybe TraceEvent
+parseLine l = case B.split 9 l of -- '\t'
+  [t, s, c] -> do
+    t' <- readNat t
+    s' <- case s of "p" -> Just Press; "r" -> Just Release; _ -> Nothing
+    c' <- readNat c
+    guard $ c' < nKeycodes
+    pure $ TraceEvent (fromIntegral t') (mkKeyEvent s' $ toEnum c')
+  _ -> Nothing
+
+-- | Parse a nonnegative decimal number without any other characters
+readNat :: ByteString -> Maybe Int
+readNat b
+  | B.null b || B.any (\w -> w < 48 || w > 57) b = Nothing
+  | otherwise = Just $ B.foldl' (\a w -> a * 10 + fromIntegral (w - 48)) 0 b
@@ -0,0 +1,226 @@
+{-# LANGUAGE BangPatterns #-}
+{-|
+Module      : KMonad.Trace.Analyze
+Description : Summary statistics over recorded input traces
+Copyright   : (c) David Janssen, 2019
+License     : MIT
+Maintainer  : janssen.dhj@gmail.com
+Stability   : experimental
+Portability : portable
+
+Reads a trace (see "KMonad.Trace") in a single pass and reports how someone
+actually types: the time between presses, how long each key is held, how many
+keys are held down at once, and how often a tap-hold key is released close to
+its timeout (which is where tap-hold buttons guess wrong).
+
+All durations are collected in fixed-size histograms, so the memory used does
+not depend on the length of the trace.
+
+-}
+module KMonad.Trace.Analyze
+  ( -- * Tap-hold timeouts
+    TapHoldDelays
+  , tapHoldDelays
+
+    -- * Analysis
+  , analyzeTrace
+  )
+where
+
+import KMonad.Prelude
+
+import RIO.List (sortOn)
+import Text.Printf (printf)
+
+import KMonad.Args.Types
+import KMonad.Keyboard
+import KMonad.Trace
+
+import qualified RIO.Map as M
+
+--------------------------------------------------------------------------------
+-- $delays
+
+-- | The timeout, in milliseconds, of every key that is bound to a tap-hold
+-- button in the base layer.
+type TapHoldDelays = M.Map Keycode Int
+
+-- | Find the tap-hold timeouts in the first layer of a config. Aliases are
+-- followed, and it is only the first layer that we look at, since that is the
+-- one a trace is mostly typed in.
+tapHoldDelays :: [KExpr] -> TapHoldDelays
+tapHoldDelays es = case (srcs, lys) of
+  (s:_, DefLayer _ bs:_) -> M.fromList
+    [ (c, d) | (c, b) <- zip s bs, Just d <- [delayOf (10 :: Int) b] ]
+  _ -> M.empty
+  where
+    srcs = es^..folded._KDefSrc
+    lys = es^..folded._KDefLayer
+    als = concat $ es^..folded._KDefAlias
+
+    -- Aliases can refer to each other, so guard against cycles
+    delayOf 0 _ = Nothing
+    delayOf n b = case b of
+      KRef t                  -> lookup t als >>= delayOf (n - 1)
+      KTapHold d _ _          -> Just d
+      KTapHoldNext d _ _      -> Just d
+      KTapHoldNextRelease d _ _ -> Just d
+      _                       -> Nothing
+
+
+--------------------------------------------------------------------------------
+-- $hist
+
+-- | A histogram of durations in 5ms bins up to 2s, with 1 bin for everything
+-- longer.
+data Hist = Hist
+  { _hCount :: !Int
+  , _hSum   :: !Word64            -- ^ In microseconds
+  , _hMax   :: !Word64            -- ^ In microseconds
+  , _hBins  :: !(M.Map Int Int)   -- ^ Count per bin
+  }
+makeLenses ''Hist
+
+-- | The width of a bin, in microseconds
+binWidth :: Word64
+binWidth = 5000
+
+-- | The bin that collects everything longer than 2s
+overflowBin :: Int
+overflowBin = 400
+
+emptyHist :: Hist
+emptyHist = Hist 0 0 0 M.empty
+
+-- | Add a duration in microseconds to a 'Hist'
+addHist :: Word64 -> Hist -> Hist
+addHist us (Hist n s m bs) = Hist (n + 1) (s + us) (max m us)
+  (M.insertWith (+) (min overflowBin . fromIntegral $ us `div` binWidth) 1 bs)
+
+-- | The upper bound of the bin that contains a percentile, 'Nothing' if that
+-- lies in the overflow bin.
+percentile :: Double -> Hist -> Maybe Word64
+percentile p h = go 0 (M.toAscList $ h^.hBins)
+  where
+    target = ceiling (p * fromIntegral (h^.hCount)) :: Int
+    go _ [] = Nothing
+    go !acc ((b, n):rest)
+      | acc + n >= target = if b == overflowBin then Nothing
+                            else Just $ fromIntegral (b + 1) * binWidth
+      | otherwise         = go (acc + n) rest
+
+
+--------------------------------------------------------------------------------
+-- $stats
+
+-- | How the releases of a tap-hold key relate to its timeout
+data NearCount = NearCount
+  { _taps      :: !Int -- ^ Released before the timeout
+  , _holds     :: !Int -- ^ Released after the timeout
+  , _nearTaps  :: !Int -- ^ Taps that were almost holds
+  , _nearHolds :: !Int -- ^ Holds that were almost taps
+  }
+makeLenses ''NearCount
+
+-- | Everything we track while folding over a trace
+data Stats = Stats
+  { _events    :: !Int
+  , _lastPress :: !(Maybe Word64)        -- ^ Time of the previous press
+  , _down      :: !(M.Map Keycode Word64) -- ^ When each held key was pressed
+  , _intervals :: !Hist                  -- ^ Time between subsequent presses
+  , _holdTimes :: !(M.Map Keycode Hist)   -- ^ How long each key was held
+  , _rollover  :: !(M.Map Int Int)       -- ^ Keys held after each press
+  , _near      :: !(M.Map Keycode NearCount)
+  , _duration  :: !Word64
+  }
+makeLenses ''Stats
+
+emptyStats :: Stats
+emptyStats = Stats 0 Nothing M.empty emptyHist M.empty M.empty M.empty 0
+
+-- | Update the 'Stats' with 1 event
+step :: TapHoldDelays -> Double -> Stats -> TraceEvent -> Stats
+step ds w s (TraceEvent t e)
+  | isPress e = s'
+      & lastPress .~ Just t
+      & intervals %~ maybe id (\l -> addHist (t - l)) (s^.lastPress)
+      & down      .~ dn
+      & rollover  %~ M.insertWith (+) (M.size dn) 1
+  | otherwise = case M.lookup c (s^.down) of
+      -- A release without a press happens when the trace starts mid-hold
+      Nothing -> s'
+      Just p  -> s'
+        & down      %~ M.delete c
+        & holdTimes %~ M.alter (Just . addHist (t - p) . fromMaybe emptyHist) c
+        & near      %~ (\m -> maybe m (\d -> M.alter (nearTo (t - p) d) c m) (M.lookup c ds))
+  where
+    c  = e^.keycode
+    s' = s & events +~ 1 & duration .~ t
+    dn = M.insert c t (s^.down)
+
+    -- Classify a hold of 'us' microseconds against a timeout of 'd' ms
+    nearTo us d = Just . f . fromMaybe (NearCount 0 0 0 0)
+      where
+        d'  = 1000 * fromIntegral d :: Double
+        us' = fromIntegral us
+        isNear = abs (us' - d') <= w * d'
+        f n | us' < d'  = n & taps  +~ 1 & nearTaps  +~ bool 0 1 isNear
+            | otherwise = n & holds +~ 1 & nearHolds +~ bool 0 1 isNear
+
+
+--------------------------------------------------------------------------------
+-- $report
+
+-- | Analyze a trace, returning a readable report.
+analyzeTrace :: MonadUnliftIO m
+  => TapHoldDelays -- ^ The tap-hold timeouts to compare holds against
+  -> Double        -- ^ How near to the timeout counts as near, as a fraction
+  -> FilePath      -- ^ The trace to read
+  -> m Utf8Builder
+analyzeTrace ds w f = report ds w <$> foldTrace f (step ds w) emptyStats
+
+-- | Describe the final 'Stats'
+report :: TapHoldDelays -> Double -> Stats -> Utf8Builder
+report ds w s = mconcat
+  [ "events:   ", display (s^.events), " over ", ms (s^.duration), "\n"
+  , "\ninterval between presses:\n", hist (s^.intervals)
+  , "\nkeys held at each press:\n"
+  , foldMap depth . M.toAscList $ s^.rollover
+  , "\nhold time per key:\n"
+  , foldMap holdLine . sortOn (negate . view hCount . snd) . M.toList
+    $ s^.holdTimes
+  , if M.null ds then "" else mconcat
+    [ "\ntap-hold releases within ", display (round (100 * w) :: Int)
+    , "% of the timeout:\n"
+    , foldMap nearLine . M.toList $ s^.near
+    ]
+  ]
+  where
+    total = max 1 . sum . M.elems $ s^.rollover
+    pct :: Int -> Int -> Utf8Builder
+    pct n d = fromString $ printf "%5.1f%%" (100 * fromIntegral n / fromIntegral (max 1 d) :: Double)
+
+    ms :: Word64 -> Utf8Builder
+    ms us = fromString $ printf "%.1fms" (fromIntegral us / 1000 :: Double)
+
+    pctl p h = maybe "> 2000ms" ms $ percentile p h
+    hist h
+      | h^.hCount == 0 = "  (none)\n"
+      | otherwise = mconcat
+        [ "  n=", display (h^.hCount)
+        , "  mean=", ms (h^.hSum `div` fromIntegral (h^.hCount))
+        , "  p50=", pctl 0.5 h, "  p90=", pctl 0.9 h, "  p99=", pctl 0.99 h
+        , "  max=", ms (h^.hMax), "\n"
+        ]
+
+    depth (d, n) = mconcat ["  ", display d, ": ", display n, "  ", pct n total, "\n"]
+
+    holdLine (c, h) = "  " <> display c <> hist h
+
+    nearLine (c, n) = mconcat
+      [ "  ", display c, " (", display (M.findWithDefault 0 c ds), "ms)"
+      , "  taps=", display (n^.taps), " near=", display (n^.nearTaps)
+      , " ", pct (n^.nearTaps) (n^.taps)
+      , "  holds=", display (n^.holds), " near=", display (n^.nearHolds)
+      , " ", pct (n^.nearHolds) (n^.holds), "\n"
+      ]
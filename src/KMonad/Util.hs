@@ -27,6 +27,9 @@ module KMonad.Util
   , withLaunch_
   , launch
   , launch_
+
+    -- * Tracing helpers
+  , traceMark
   )
 
 where
@@ -35,6 +38,7 @@ import KMonad.Prelude
 
 import Data.Time.Clock
 import Data.Time.Clock.System
+import Debug.Trace (traceMarkerIO)
 
 --------------------------------------------------------------------------------
 -- $time
@@ -125,3 +129,15 @@ launch_ :: HasLogFunc e
   -> RIO e a -- ^ The action to repeat forever
   -> ContT r (RIO e) ()
 launch_ n a = ContT $ \next -> withLaunch_ n a (next ())
+
+--------------------------------------------------------------------------------
+-- $trace
+
+-- | Emit a marker into the GHC eventlog, but only if the flag is set. This
+-- makes it possible to line up KMonad's processing with GC and scheduling
+-- activity using tools like @ghc-events@ or @eventlog2html@.
+--
+-- NOTE: markers only end up in the eventlog when KMonad is run with @+RTS -l@.
+traceMark :: MonadIO m => Bool -> String -> m ()
+traceMark False _ = pure ()
+traceMark True  s = liftIO $ traceMarkerIO s